@@ -4,10 +4,16 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h> /* Needed for boolean datatype */
 #include <math.h>
 #include <mpi.h>
+#include <omp.h>
+#include <sched.h>
+
+/* MPI type matching dfloat */
+#define MPI_DFLOAT ((sizeof(dfloat)==sizeof(double)) ? MPI_DOUBLE : MPI_FLOAT)
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #define max(a,b) (((a) > (b)) ? (a) : (b))
@@ -27,6 +33,39 @@
 #define CYLINDER 5
 #define RECTANGLE 6
 
+/* frame output modes */
+#define OUTPUT_MPIIO  1  // every rank writes its rows with collective MPI-IO
+#define OUTPUT_GATHER 2  // rows are gathered to rank 0 which writes the frame
+#define OUTPUT_Y4M    3  // frames are gathered and appended to one YUV4MPEG2 (4:2:0) stream
+#define OUTPUT_RGB    4  // frames are gathered and appended to one raw RGB stream
+#define OUTPUT_QOI    5  // every rank compresses its rows (QOI) and writes them with MPI-IO
+
+/* sphere layouts of the scene generator */
+#define SCENE_DROP    1  // the classic scene: columns of spheres dropped onto the shapes
+#define SCENE_LATTICE 2  // layers of equal spheres on a lattice above the ground
+#define SCENE_JITTER  3  // lattice with random radii and jittered centres (no overlaps)
+
+/* kinds of captured rays */
+#define CAPTURE_PRIMARY   0
+#define CAPTURE_SHADOW    1
+#define CAPTURE_REFLECTED 2
+#define CAPTURE_REFRACTED 3
+
+// mesh cloned for the bunnies
+#define p_bunnyFile "bunny.ply"
+
+// rows passed to the output at a time by the communication thread
+#define p_outputBand 16
+// bands of rows (besides one row per thread) in the ring buffer of the -ring option
+#define p_outputRingBands 4
+// threads waiting on the output sleep between checks, from 1 microsecond
+// doubling up to p_outputMaxBackoff microseconds while nothing changes
+#define p_outputMaxBackoff 1000
+// frame rate written in the Y4M stream header
+#define p_videoFrameRate 25
+// rows of a QOI image compressed as one block (blocks are compressed in parallel)
+#define p_qoiBlockRows 8
+
 #define p_eps 1e-6
 
 #define p_Nsamples 1
@@ -41,7 +80,57 @@
 
 #define p_maxLevel 4
 #define p_maxNrays (2<<p_maxLevel)
-#define p_maxNcollisions 8
+// contacts kept per sphere (12 touching spheres and a static surface fit)
+#define p_maxNcontacts 16
+
+// bodies tested at a time by the vectorised broadphase distance tests
+#define p_simdWidth 8
+
+// contact solver: Jacobi iterations and relaxation, restitution of sphere and
+// static contacts, slower contacts (radii per unit time) do not bounce, fraction
+// of the overlap beyond the slop (in radii) removed per substep
+#define p_solverIterations 8
+#define p_jacobiRelaxation 0.5
+#define p_sphereRestitution 1.
+#define p_staticRestitution 0.8
+#define p_restRate 0.1
+#define p_contactBias 0.2
+#define p_contactSlop 0.01
+
+// sphere physics time advanced per frame
+#define p_frameTime 1.
+// radii a sphere may move in one substep (continuous collision detection stops
+// tunnelling, this bounds the broadphase cells and halo)
+#define p_cfl 1.
+
+// render grid: spheres are listed by their bounds grown by the distance they
+// move in p_gridFattening frames, at most p_gridMaxMargin radii
+#define p_gridFattening 2.
+#define p_gridMaxMargin 2.
+// continuous collision detection: contact tolerance (in radii), conservative
+// advancement iterations and impacts per sphere per substep
+#define p_ccdTolerance 0.01
+#define p_ccdMaxIterations 32
+#define p_ccdMaxImpacts 4
+// bound on the substeps taken per frame (faster bodies are slowed down to p_cfl)
+#define p_maxNsubSteps 400
+// spheres moving less than p_sleepRate radii per unit time over a substep, with a net
+// acceleration (gravity and contact impulses) under p_sleepRate of gravity, for
+// p_sleepSteps substeps go to sleep
+#define p_sleepRate 0.05
+#define p_sleepSteps 8
+// scene cache (see sceneCacheSetup): format version, arrays per cache and their alignment
+#define p_cacheVersion 2
+#define p_cacheMaxArrays 16
+#define p_cacheAlignment 64
+// checkpoint file format version
+#define p_checkpointVersion 2
+// ray capture: one in p_captureEvery lens samples is captured with all its
+// secondary rays, capture file format version
+#define p_captureEvery 16
+#define p_captureVersion 2
+// tokens on one line of a scene file
+#define p_sceneMaxTokens 64
 #define p_apertureRadius 20.f
 #define NRANDOM 10000
 
@@ -60,13 +149,12 @@ typedef struct{
   dfloat x,y,z;
 }vector_t;
 
-/* The sphere */
+/* The sphere (render copy, the dynamic state lives in bodies_t) */
 typedef struct{
   vector_t pos;
   dfloat  radius;
-  vector_t velocity;
-  vector_t newVelocity;
-  vector_t force;
+  dfloat  speed; // of the body when the copy was refreshed (sets its grid margin)
+  int     body;  // index of the sphere in bodies_t
 }sphere_t; 
 
 /* The triangle */
@@ -74,6 +162,27 @@ typedef struct{
   vector_t vertices[3];
 }triangle_t;
 
+/* mesh vertices are stored in dfloat unless compiled with -DmeshFloat=float */
+#ifndef meshFloat
+#define meshFloat dfloat
+#endif
+
+typedef struct{
+  meshFloat x,y,z;
+}meshVertex_t;
+
+/* indexed triangle mesh, face f joins vertices faces[3*f], faces[3*f+1], faces[3*f+2] */
+typedef struct{
+  int           Nvertices;
+  meshVertex_t *vertices;
+
+  int  Nfaces;
+  int *faces;
+
+  int  material;
+  int *faceMaterials; // material of each face (NULL if all faces use material)
+}mesh_t;
+
 /* The rectangle */
 typedef struct{
   vector_t center;
@@ -204,10 +313,252 @@ typedef struct{
   int *boxContents;
   bbox_t  *bboxes;
   int     *boxStarts;
+
+  int     *sphereStarts;   // spheres listed by their fattened bounds (see gridUpdateSpheres)
+  int     *sphereContents;
+  int     *sphereCounters; // scratch
+
+  const mesh_t *mesh;      // mesh faces listed by their bounds (see gridPopulateMesh)
+  int     *faceStarts;
+  int     *faceContents;
 }grid_t;
 
+/* structure of arrays state of the dynamic spheres, body b is shape shapeIds[b] */
+typedef struct{
+  int  Nbodies;
+  int *shapeIds;
+
+  dfloat *x;   // position
+  dfloat *y;
+  dfloat *z;
+  dfloat *radius;
+  dfloat *vx;  // velocity
+  dfloat *vy;
+  dfloat *vz;
+  dfloat *nvx; // post-collision velocity
+  dfloat *nvy;
+  dfloat *nvz;
+  dfloat *fx;  // force
+  dfloat *fy;
+  dfloat *fz;
+
+  dfloat *contactCutoff; // shallowest sphere contact overlap kept by a crowded body (0 keeps all)
+
+  int *slowSteps; // consecutive substeps below the sleep speed
+  int *asleep;    // sleeping bodies are not integrated until an awake body touches them
+}bodies_t;
+
+/* body state sent between ranks */
+typedef struct{
+  int body;
+  int slowSteps;
+  int asleep;
+  dfloat x, y, z;
+  dfloat vx, vy, vz;
+  dfloat nvx, nvy, nvz;
+  dfloat fx, fy, fz;
+  dfloat contactCutoff;
+}bodyPacket_t;
+
+/* body position gathered for the render copy (see domainGather) */
+typedef struct{
+  int body;
+  dfloat x, y, z;
+  dfloat speed;
+}renderPacket_t;
+
+/* checkpoint file header, followed by the packets of all bodies, the offsets of
+   the per rank sections and the sections themselves (see checkpointSave) */
+typedef struct{
+  char magic[8];   // "SRTCHECK"
+  int  version;    // p_checkpointVersion
+  int  layouts[4]; // sizeof(dfloat), sizeof(bodyPacket_t), sizeof(contact_t), p_maxNcontacts
+  int  frame;      // first frame rendered from this state
+  int  Nbodies;
+  int  Nranks;     // ranks that wrote the sections
+  uint64_t sceneHash; // of the inputs of the scene the bodies belong to
+}checkpointHeader_t;
+
+/* slab decomposition of the sphere physics */
+typedef struct{
+  MPI_Comm comm;
+  int rank;
+  int size;
+  int Nslabs; // ranks with a slab (the first Nslabs, see domainSetup)
+  int left;   // neighbouring ranks (MPI_PROC_NULL at the ends)
+  int right;
+
+  dfloat xmin; // extent of slab owned by this rank
+  dfloat xmax;
+  dfloat haloWidth; // bodies this close to the slab edge are sent to the neighbour
+
+  int  Nbodies;    // all bodies in the scene
+
+  int  Nowned;     // bodies with centre in this slab
+  int *owned;
+
+  int  step;       // incremented by every exchange
+  int *stamps;     // step when state of each body was last current on this rank
+
+  bodyPacket_t *leftBuffer;
+  bodyPacket_t *rightBuffer;
+  bodyPacket_t *recvBuffer;
+  int *recvCounts;
+  int *recvOffsets;
+
+  renderPacket_t *renderSend;
+  renderPacket_t *renderRecv;
+
+  MPI_Datatype MPI_BODY_PACKET;
+  MPI_Datatype MPI_RENDER_PACKET;
+}domain_t;
+
+/* hashed cell list of bodies for sphere-sphere collisions */
+typedef struct{
+  int sleeping;        // holds the sleeping (1) or the awake (0) bodies
+
+  dfloat cellSize;     // twice the largest sphere radius plus the largest substep motion
+  dfloat invCellSize;
+
+  int  Nbuckets;       // power of two
+  int *bucketStarts;   // bodies in bucket b are bucketContents[bucketStarts[b]..bucketStarts[b+1]-1]
+  int *bucketContents;
+  int *bucketCounts;   // scratch
+
+  dfloat *sortedX;     // positions and radii in bucket order (contiguous for vectorised tests)
+  dfloat *sortedY;
+  dfloat *sortedZ;
+  dfloat *sortedR;
+
+  int  Nlocal;         // bodies sorted into buckets
+  int *localIds;       // scratch
+  int *bodyBuckets;    // scratch
+
+  int *members;        // sorted in at the last build (sleeping broadphase is only rebuilt when this changes)
+}broadphase_t;
+
+/* narrow band distance field of the static shapes */
+typedef struct{
+  int NI; // number of nodes in x direction (static grid cell corners)
+  int NJ;
+  int NK;
+  dfloat xmin;
+  dfloat ymin;
+  dfloat zmin;
+  dfloat dx;
+  dfloat dy;
+  dfloat dz;
+
+  dfloat band;  // distances are clamped to this
+  float *dist;  // unsigned distance at nodes
+  int   cached; // dist lives in a scene cache mapping (see sceneCacheSetup)
+}sdf_t;
+
+/* contact between a sphere and another sphere or the static shapes */
+typedef struct{
+  int      other;   // other body, -1 for the static shapes
+  vector_t normal;  // unit normal pointing towards the sphere
+  dfloat   mass;    // effective mass along the normal
+  dfloat   target;  // normal velocity the contact should end with
+  dfloat   impulse; // accumulated normal impulse
+}contact_t;
+
+/* persistent contacts of the bodies for the contact solver */
+typedef struct{
+  int       *Ncontacts; // number of contacts of each body
+  contact_t *contacts;  // p_maxNcontacts per body
+}solver_t;
+
+/* frame output shared by all ranks */
+typedef struct{
+  MPI_Comm comm;
+  int rank;
+  int size;
+  int mode;   // one of the OUTPUT_ modes
+  int width;
+  int height;
+
+  char fileName[BUFSIZ];
+
+  int rowStart;     // image rows of this rank in the current frame
+  int rowEnd;
+  int rowsWritten;  // rows of this rank already passed to the output
+  int ringRows;     // rows held in the image buffer at a time (0 for the whole stripe)
+
+  MPI_Datatype MPI_ROW;
+
+  // OUTPUT_MPIIO
+  MPI_File   fh;
+  MPI_Offset headerLength;
+
+  // OUTPUT_QOI
+  unsigned char *qoi;     // compressed rows of this rank
+  size_t         qoiSize; // capacity of qoi
+
+  // OUTPUT_GATHER, OUTPUT_Y4M and OUTPUT_RGB (root only)
+  unsigned char *frame;
+  int rowsReceived;
+
+  // OUTPUT_Y4M and OUTPUT_RGB (root only)
+  FILE          *stream; // stdout if the stream name is "-"
+  unsigned char *yuv;    // Y, U and V planes of the frame
+}output_t;
+
+/* a captured ray and the result of its intersection search */
+typedef struct{
+  vector_t start;
+  vector_t dir;
+  dfloat   t;     // distance to the hit (unset for a miss)
+  int      shape; // shape hit, -1 for none (Nshapes+face for mesh faces, see gridShape)
+  short    level; // recursion level that launched the ray
+  short    kind;  // one of the CAPTURE_ kinds
+}rayRecord_t;
+
+/* ray capture file header, followed by the packets of all bodies (the sphere
+   state of the captured frame) and the records of all ranks */
+typedef struct{
+  char    magic[8];   // "SRTRAYS"
+  int     version;    // p_captureVersion
+  int     layouts[3]; // sizeof(dfloat), sizeof(bodyPacket_t), sizeof(rayRecord_t)
+  int     frame;
+  int     Nbodies;
+  int64_t Nrays;
+  uint64_t sceneHash; // of the inputs of the scene the rays were traced in
+}captureHeader_t;
+
+/* intersection search replayed by the replay driver (gridRayIntersectionSearch
+   is one), finds the shape nearest along r and sets t, -1 in currentShape if none */
+typedef bool (*intersectionSearch_t)(const ray_t r, const int Nshapes, const shape_t *shapes, const grid_t grid,
+				     dfloat *t, int *currentShape);
+
+/* rays captured by the threads of a rank */
+typedef struct{
+  int every;          // one in every lens samples is captured
+  int Nthreads;
+  size_t *Nrays;      // records of each thread
+  size_t *maxNrays;
+  rayRecord_t **rays;
+}capture_t;
+
 void saveppm(char *filename, unsigned char *img, int width, int height);
 
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE     8
+int    qoiHeader(const int width, const int height, unsigned char *header);
+size_t qoiBound(const size_t Npixels);
+size_t qoiEncode(const unsigned char *rgb, const size_t Npixels, const unsigned char *prev, unsigned char *out);
+int    qoiEnd(unsigned char *end);
+
+output_t *outputSetup(MPI_Comm comm, const int mode, const int width, const int height, const char *streamName,
+		      const int ring);
+int outputBufferRows(const output_t *output);
+unsigned char *outputRow(const output_t *output, unsigned char *img, const int row);
+void outputFrameBegin(output_t *output, const char *fileName, const int rowStart, const int rowEnd);
+void outputRows(output_t *output, unsigned char *img, int Nrows);
+int  outputProgress(output_t *output);
+void outputFrameEnd(output_t *output, unsigned char *img);
+void outputFree(output_t *output);
+
 
 
 vector_t vectorCreate(dfloat x, dfloat y, dfloat z);
@@ -228,15 +579,108 @@ typedef struct{
 
   int Nshapes;
   shape_t *shapes;
+
+  mesh_t *mesh;  // triangles of all the bunnies
   
   int Nlights;
   light_t *lights;
 
   grid_t *grid;
+
+  sensor_t sensor;   // camera
+
+  void  *cache;      // mapping holding the arrays when loaded from a cache
+  size_t cacheSize;
+
+  uint64_t hash;     // of the inputs the scene was built from (see sceneCacheSetup)
   
 } scene_t;
 
-scene_t *sceneSetup();
+/* scene generator parameters (see sceneParseOptions) */
+typedef struct{
+  int    Nspheres;
+  int    Nbunnies;
+  int    Ncones;
+  int    Ncylinders; // each cylinder also has two end disks
+  int    layout;     // SCENE_DROP, SCENE_LATTICE or SCENE_JITTER
+  dfloat radius;     // smallest sphere radius
+  dfloat L;          // world size in x and z
+  int    seed;       // for SCENE_JITTER
+
+  const char *sceneFile; // scene description file replacing the generator (NULL to generate)
+  const char *cacheFile; // built scene is cached here (NULL to always build)
+}sceneOptions_t;
+
+/* scene cache file header, the arrays follow at the listed offsets */
+typedef struct{
+  char     magic[8];  // "SRTCACHE"
+  int      version;   // p_cacheVersion
+  uint64_t hash;      // of the scene inputs, the build parameters and the struct layouts
+  size_t   size;      // of the whole file
+
+  // scalar parts of the cached structures (pointers are reset on load)
+  scene_t scene;
+  grid_t  grid;
+  mesh_t  mesh;
+  sdf_t   sdf;
+
+  int    Narrays;
+  size_t offsets[p_cacheMaxArrays];
+  size_t bytes[p_cacheMaxArrays];
+}sceneCacheHeader_t;
+
+/* one line of a scene file split into tokens (see sceneFileSetup) */
+typedef struct{
+  const char *fileName;
+  int   line;
+  int   Ntokens;
+  int   next;   // next token to read
+  char *tokens[p_sceneMaxTokens];
+}sceneFileLine_t;
+
+/* PLY file formats and property types (readPlyModel) */
+#define PLY_ASCII      1
+#define PLY_BINARY_LE  2
+#define PLY_BINARY_BE  3
+
+#define PLY_INT8    1
+#define PLY_UINT8   2
+#define PLY_INT16   3
+#define PLY_UINT16  4
+#define PLY_INT32   5
+#define PLY_UINT32  6
+#define PLY_FLOAT32 7
+#define PLY_FLOAT64 8
+
+#define p_plyMaxElements   8
+#define p_plyMaxProperties 16
+
+typedef struct{
+  char name[64];
+  int  type;      // scalar type, or item type of a list
+  int  countType; // type of the list length, 0 for scalar properties
+}plyProperty_t;
+
+typedef struct{
+  char name[64];
+  long count;
+  int  Nproperties;
+  plyProperty_t properties[p_plyMaxProperties];
+}plyElement_t;
+
+typedef struct{
+  int    format;       // PLY_ASCII, PLY_BINARY_LE or PLY_BINARY_BE
+  size_t headerLength; // bytes up to and including the end_header line
+  int    Nelements;
+  plyElement_t elements[p_plyMaxElements];
+}plyHeader_t;
+
+sceneOptions_t sceneParseOptions(int argc, char **argv);
+scene_t *sceneSetup(const sceneOptions_t *options);
+scene_t *sceneFileSetup(MPI_Comm comm, const char *fileName);
+grid_t  *sceneGridSetup(const dfloat L, const dfloat margin, const int NI, const int NJ, const int NK);
+void sceneFree(scene_t *scene);
+scene_t *sceneCacheSetup(MPI_Comm comm, const sceneOptions_t *options, sdf_t **sdf);
 
 void render(const scene_t *scene,
 	    const dfloat costheta,
@@ -281,7 +725,11 @@ bbox_t createBoundingBoxRectangle(rectangle_t rectangle);
 bbox_t createBoundingBoxDisk(disk_t disk);
 bbox_t createBoundingBoxShape(const grid_t grid, shape_t shape);
 
-void gridCountShapesInCellsKernel(const grid_t grid, const int Nshapes, shape_t *shapes, int *counts);
+void gridCountShapesInCellsKernel(const grid_t grid, const int Nshapes, const int *ids, shape_t *shapes, int *counts);
+
+bool gridRayIntersectionSearch(const ray_t r,
+			       const int Nshapes, const shape_t *shapes, const  grid_t grid,
+			       dfloat *t, int *currentShape);
 
 colour_t gridTrace(const grid_t grid,
 		   const int Nshapes,
@@ -293,7 +741,8 @@ colour_t gridTrace(const grid_t grid,
 		   ray_t  r,
 		   int    level,
 		   dfloat coef,
-		   colour_t bg);
+		   colour_t bg,
+		   capture_t *capture);
 
 dfloat projectPointRectangle(const vector_t p, const rectangle_t rect, vector_t *closest);
 dfloat projectPointDisk(const vector_t p, const disk_t disk, vector_t *closest);
@@ -307,33 +756,127 @@ void initTimer();
 void ticTimer();
 void tocTimer(const char *message);
 
+sensor_t sensorSetup();
+sensor_t sensorLookAt(const vector_t eye, const vector_t target, const dfloat focus);
+dfloat *sensorRandomNumbers();
+
 vector_t sensorLocation(const int NI,
 			const int NJ,
 			const int I,
 			const int J,
 			const sensor_t sensor);
 
-void gridPopulate(grid_t *grid, int Nshapes, shape_t *shapes);
+void gridPopulateShapes(grid_t *grid, int Nshapes, const int *ids, shape_t *shapes);
+void gridPopulateStatic(grid_t *grid, const int Nshapes, shape_t *shapes, const mesh_t *mesh);
+void gridPopulateMesh(grid_t *grid, const mesh_t *mesh);
+shape_t gridShape(const grid_t &grid, const int Nshapes, const shape_t *shapes, const int id);
+int gridUpdateSpheres(grid_t *grid, const bodies_t *bodies, shape_t *shapes);
+int gridScan(const int N, const int *v, int *scanv);
 
 void renderKernel(const int NI,
 		  const int NJ,
+		  const int rowStart,
+		  const int rowEnd,
 		  scene_t scene,
 		  const sensor_t sensor,
 		  const dfloat costheta,
 		  const dfloat sintheta,
 		  const dfloat *randomNumbers,
-		  unsigned char *img);
-
-void readPlyModel(const char *fileName, int *Ntriangles, triangle_t **triangles);
-
-void sphereCollisions(const grid_t *grid,
+		  unsigned char *img,
+		  dfloat *rowCost,
+		  output_t *output,
+		  capture_t *capture);
+
+void readPlyModel(const char *fileName, mesh_t *mesh);
+void bcastPlyModel(MPI_Comm comm, const char *fileName, mesh_t *mesh);
+
+triangle_t meshTriangle(const mesh_t *mesh, const int face);
+shape_t meshShape(const mesh_t *mesh, const int face);
+void meshFree(mesh_t *mesh);
+
+void sphereWake(domain_t *domain,
+		const broadphase_t *awake,
+		const broadphase_t *sleeping,
+		bodies_t *bodies);
+
+void sphereCollisions(const sdf_t *sdf,
+		      const broadphase_t *awake,
+		      const broadphase_t *sleeping,
+		      solver_t *solver,
+		      domain_t *domain,
 		      const dfloat dt,
 		      const dfloat g,
-		      const int Nshapes,
-		      shape_t *shapes);
+		      bodies_t *bodies);
 
-void sphereUpdates(grid_t *grid,
-		   const dfloat dt,
-		   const dfloat g,
-		   const int Nshapes,
-		   shape_t *shapes);
+int sphereUpdates(const sdf_t *sdf,
+		  const broadphase_t *awake,
+		  const domain_t *domain,
+		  const dfloat dt,
+		  const dfloat g,
+		  bodies_t *bodies);
+
+dfloat sphereTimeStep(const domain_t *domain,
+		      const dfloat dtMax,
+		      const dfloat g,
+		      const bodies_t *bodies);
+
+int sphereFrame(const sdf_t *sdf,
+		broadphase_t *awake,
+		broadphase_t *sleeping,
+		solver_t *solver,
+		domain_t *domain,
+		const dfloat g,
+		bodies_t *bodies,
+		int *Nasleep);
+
+bodies_t *bodiesSetup(const int Nshapes, shape_t *shapes);
+void bodiesToShapes(const bodies_t *bodies, shape_t *shapes);
+void bodiesFree(bodies_t *bodies);
+
+domain_t *domainSetup(MPI_Comm comm, const grid_t *grid, const bodies_t *bodies);
+void domainHaloExchange(domain_t *domain, bodies_t *bodies);
+void domainGather(domain_t *domain, const bodies_t *bodies, shape_t *shapes);
+void domainGatherState(const domain_t *domain, const bodies_t *bodies, bodyPacket_t *packets);
+void domainHaloRefresh(domain_t *domain, bodies_t *bodies);
+void domainFree(domain_t *domain);
+void domainClaim(domain_t *domain, const bodies_t *bodies);
+void domainPackBody(const bodies_t *bodies, const int b, bodyPacket_t &packet);
+void domainUnpackBody(const bodyPacket_t &packet, bodies_t *bodies);
+
+capture_t *captureSetup(const int every);
+void captureRay(capture_t *capture, const ray_t &r, const int kind, const dfloat t, const int shape);
+void captureSave(MPI_Comm comm, const char *fileName, const int frame, const uint64_t sceneHash,
+		 const bodies_t *bodies, const domain_t *domain, const capture_t *capture);
+rayRecord_t *captureLoad(MPI_Comm comm, const char *fileName, const uint64_t sceneHash, bodies_t *bodies,
+			 int *frame, int64_t *Nrays);
+void captureFree(capture_t *capture);
+
+void checkpointSave(MPI_Comm comm, const char *fileName, const int frame, const uint64_t sceneHash,
+		    const bodies_t *bodies, const domain_t *domain, const solver_t *solver);
+int  checkpointLoad(MPI_Comm comm, const char *fileName, const uint64_t sceneHash,
+		    bodies_t *bodies, domain_t *domain, solver_t *solver);
+
+void balancePartition(const int Nrows, const dfloat *rowCost, const int Nparts, int *rowStarts);
+dfloat balanceImbalance(const int Nparts, const dfloat *partCost);
+dfloat balancePredictImbalance(const int Nrows, const dfloat *rowCost, const int Nparts, const int *rowStarts);
+
+broadphase_t *broadphaseSetup(const bodies_t *bodies, const int sleeping);
+void broadphaseBuild(broadphase_t *broadphase, const domain_t *domain, const bodies_t *bodies);
+int broadphaseOverlaps(const broadphase_t *broadphase, const int bucket,
+		       const dfloat x, const dfloat y, const dfloat z, const dfloat r,
+		       const int maxNhits, int *hits);
+int broadphaseCell(const broadphase_t *broadphase, const dfloat x);
+int broadphaseBucket(const broadphase_t *broadphase, const int i, const int j, const int k);
+void broadphaseFree(broadphase_t *broadphase);
+
+sdf_t *sdfSetup(const grid_t *staticGrid, const int Nshapes, const shape_t *shapes);
+dfloat sdfDistance(const sdf_t *sdf, const vector_t p, vector_t *normal);
+void sdfFree(sdf_t *sdf);
+
+solver_t *solverSetup(const bodies_t *bodies);
+contact_t *solverContacts(const solver_t *solver, const int body);
+dfloat solverCachedImpulse(const int Ncached, const contact_t *cached, const int other);
+dfloat solverContactTarget(const dfloat vn, const dfloat overlap, const dfloat radius,
+			   const dfloat restitution, const dfloat dt);
+void solverSolve(solver_t *solver, domain_t *domain, bodies_t *bodies);
+void solverFree(solver_t *solver);
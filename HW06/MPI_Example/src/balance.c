@@ -0,0 +1,81 @@
+#include "simpleRayTracer.h"
+
+// split rows [0,Nrows) into Nparts contiguous ranges of nearly equal cost
+// Notes:
+//
+// a. part p gets rows [rowStarts[p], rowStarts[p+1])
+// b. rowCost holds the measured cost of each row in the previous frame
+// c. without a cost profile (first frame) the rows are split into equal counts
+// d. every part gets at least one row when Nrows>=Nparts
+
+void balancePartition(const int Nrows, const dfloat *rowCost, const int Nparts, int *rowStarts){
+
+  dfloat totalCost = 0;
+  for(int row=0;row<Nrows;++row)
+    totalCost += rowCost[row];
+
+  rowStarts[0] = 0;
+  rowStarts[Nparts] = Nrows;
+
+  if(totalCost<=0){
+    for(int p=1;p<Nparts;++p)
+      rowStarts[p] = p*Nrows/Nparts;
+    return;
+  }
+
+  // walk along the cumulative cost and cut where it crosses multiples of the mean part cost
+  dfloat cost = 0;
+  int row = 0;
+  for(int p=1;p<Nparts;++p){
+    const dfloat target = p*totalCost/Nparts;
+
+    while(row<Nrows && cost+rowCost[row]<=target)
+      cost += rowCost[row++];
+
+    // cut on whichever side of the straddling row is closer to the target
+    if(row<Nrows && target-cost > cost+rowCost[row]-target)
+      cost += rowCost[row++];
+
+    rowStarts[p] = row;
+  }
+
+  // make sure no part is left empty
+  if(Nrows>=Nparts){
+    for(int p=1;p<Nparts;++p)
+      rowStarts[p] = max(rowStarts[p], rowStarts[p-1]+1);
+    for(int p=Nparts-1;p>0;--p)
+      rowStarts[p] = min(rowStarts[p], rowStarts[p+1]-1);
+  }
+}
+
+// ratio of the most expensive part to the mean part cost (1 is perfect balance)
+dfloat balanceImbalance(const int Nparts, const dfloat *partCost){
+
+  dfloat maxCost = 0, totalCost = 0;
+  for(int p=0;p<Nparts;++p){
+    maxCost = max(maxCost, partCost[p]);
+    totalCost += partCost[p];
+  }
+
+  if(totalCost<=0)
+    return 1;
+
+  return maxCost*Nparts/totalCost;
+}
+
+// imbalance expected if the rows had the given cost profile (rows past Nrows
+// have no cost)
+dfloat balancePredictImbalance(const int Nrows, const dfloat *rowCost, const int Nparts, const int *rowStarts){
+
+  dfloat *partCost = (dfloat*) calloc(Nparts, sizeof(dfloat));
+
+  for(int p=0;p<Nparts;++p)
+    for(int row=max(rowStarts[p], 0);row<min(rowStarts[p+1], Nrows);++row)
+      partCost[p] += rowCost[row];
+
+  dfloat imbalance = balanceImbalance(Nparts, partCost);
+
+  free(partCost);
+
+  return imbalance;
+}
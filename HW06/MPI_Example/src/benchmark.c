@@ -0,0 +1,194 @@
+#include "simpleRayTracer.h"
+
+// physics, grid and render timings for a range of scene sizes
+//
+// to run:
+//  mpiexec -n 4 ./benchmark -spheres 10,1000,100000 -bunnies 1,10 [-frames F] [-render] [scene options]
+//  mpiexec -n 4 ./benchmark -scene a.scene,b.scene [-frames F] [-render]
+//
+// Notes:
+//
+// a. every combination of the sphere and bunny counts (or every scene file) is
+//    a configuration, the other scene options (see sceneParseOptions) apply to
+//    all of them
+// b. times are the largest over the ranks: setup, physics per substep, sphere
+//    grid update per frame and (with -render) render per frame
+// c. rendered frames all go to images/benchmark.ppm
+// d. with -cache every configuration replaces the cache, so repeating a run of
+//    one configuration times the setup from the cache
+
+// comma separated list of counts
+static int benchmarkParseList(const char *arg, int *list){
+
+  int N = 0;
+  const char *c = arg;
+  while(*c && N<BUFSIZ){
+    list[N++] = atoi(c);
+    while(*c && *c!=',') ++c;
+    if(*c==',') ++c;
+  }
+
+  return N;
+}
+
+static double benchmarkMax(double t){
+
+  MPI_Allreduce(MPI_IN_PLACE, &t, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+  return t;
+}
+
+int main(int argc, char *argv[]){
+
+  // only the master thread of each rank makes MPI calls
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  sceneOptions_t options = sceneParseOptions(argc, argv);
+
+  int sphereCounts[BUFSIZ], bunnyCounts[BUFSIZ];
+  int NsphereCounts = 1, NbunnyCounts = 1;
+  sphereCounts[0] = options.Nspheres;
+  bunnyCounts[0]  = options.Nbunnies;
+
+  int Nframes = 3, doRender = 0;
+  for(int n=1;n<argc;++n){
+    if(!strcmp(argv[n], "-render"))                doRender = 1;
+    if(!strcmp(argv[n], "-frames")  && n+1<argc)  Nframes = atoi(argv[n+1]);
+    if(!strcmp(argv[n], "-spheres") && n+1<argc)  NsphereCounts = benchmarkParseList(argv[n+1], sphereCounts);
+    if(!strcmp(argv[n], "-bunnies") && n+1<argc)  NbunnyCounts  = benchmarkParseList(argv[n+1], bunnyCounts);
+  }
+
+  // each scene file is a configuration (the counts only apply to the generated scene)
+  const char *sceneFiles[BUFSIZ];
+  int NsceneFiles = 0;
+  char *sceneList = options.sceneFile ? strdup(options.sceneFile) : NULL;
+  for(char *name=sceneList ? strtok(sceneList, ",") : NULL;name && NsceneFiles<BUFSIZ;name=strtok(NULL, ","))
+    sceneFiles[NsceneFiles++] = name;
+  if(NsceneFiles)
+    NsphereCounts = NbunnyCounts = 1;
+  else
+    sceneFiles[NsceneFiles++] = NULL;
+
+  const dfloat g = 1;
+
+  dfloat *randomNumbers = sensorRandomNumbers();
+
+  output_t *output = outputSetup(MPI_COMM_WORLD, OUTPUT_MPIIO, WIDTH, HEIGHT, NULL, 0);
+  int *rowStarts = (int*) calloc(size+1, sizeof(int));
+  dfloat *rowCost = (dfloat*) calloc(HEIGHT, sizeof(dfloat));
+  unsigned char *img = NULL;
+
+  if(doRender)
+    mkdir("images", S_IRUSR | S_IREAD | S_IWUSR | S_IWRITE | S_IXUSR | S_IEXEC);
+
+  if(rank==0)
+    printf("%9s %8s %10s %9s %9s %17s %14s %12s %15s\n",
+	   "spheres", "bunnies", "static", "setup(s)", "substeps",
+	   "physics/step(ms)", "grid/frame(ms)", "re-inserted", "render/frame(s)");
+
+  const int Nconfigurations = NsceneFiles*NsphereCounts*NbunnyCounts;
+
+  for(int c=0;c<Nconfigurations;++c){
+
+    options.sceneFile = sceneFiles[c/(NsphereCounts*NbunnyCounts)];
+    options.Nspheres  = sphereCounts[(c/NbunnyCounts)%NsphereCounts];
+    options.Nbunnies  = bunnyCounts[c%NbunnyCounts];
+
+    if(rank==0 && options.sceneFile)
+      printf("scene %s\n", options.sceneFile);
+
+    // same set up as simpleRayTracer
+    double tic = MPI_Wtime();
+
+    sdf_t   *sdf   = NULL;
+    scene_t *scene = sceneCacheSetup(MPI_COMM_WORLD, &options, &sdf);
+    shape_t *shapes = scene->shapes;
+    grid_t  *grid = scene->grid;
+
+    bodies_t *bodies = bodiesSetup(scene->Nshapes, shapes);
+    domain_t *domain = domainSetup(MPI_COMM_WORLD, grid, bodies);
+
+    broadphase_t *awake    = broadphaseSetup(bodies, 0);
+    broadphase_t *sleeping = broadphaseSetup(bodies, 1);
+    solver_t     *solver   = solverSetup(bodies);
+
+    const double setupTime = benchmarkMax(MPI_Wtime()-tic);
+
+    double physicsTime = 0, gridTime = 0, renderTime = 0;
+    int NsubSteps = 0, Nreinserted = 0;
+
+    for(int frame=0;frame<Nframes;++frame){
+
+      domainGather(domain, bodies, shapes);
+
+      tic = MPI_Wtime();
+      Nreinserted += gridUpdateSpheres(grid, bodies, shapes);
+      gridTime += benchmarkMax(MPI_Wtime()-tic);
+
+      if(doRender){
+	balancePartition(HEIGHT, rowCost, size, rowStarts);
+	const int rowStart = rowStarts[rank];
+	const int rowEnd   = rowStarts[rank+1];
+	img = (unsigned char*) realloc(img, 3*WIDTH*(rowEnd-rowStart)*sizeof(char));
+
+	for(int row=0;row<HEIGHT;++row)
+	  rowCost[row] = 0;
+
+	tic = MPI_Wtime();
+
+	outputFrameBegin(output, "images/benchmark.ppm", rowStart, rowEnd);
+	renderKernel(WIDTH, HEIGHT, rowStart, rowEnd, scene[0], scene->sensor, 1, 0, randomNumbers, img, rowCost, output, NULL);
+	outputFrameEnd(output, img);
+
+	renderTime += benchmarkMax(MPI_Wtime()-tic);
+
+	MPI_Allreduce(MPI_IN_PLACE, rowCost, HEIGHT, MPI_DFLOAT, MPI_SUM, MPI_COMM_WORLD);
+      }
+
+      int Nasleep;
+      tic = MPI_Wtime();
+      NsubSteps += sphereFrame(sdf, awake, sleeping, solver, domain, g, bodies, &Nasleep);
+      physicsTime += benchmarkMax(MPI_Wtime()-tic);
+    }
+
+    char renderColumn[BUFSIZ] = "-";
+    if(doRender)
+      sprintf(renderColumn, "%.3f", renderTime/Nframes);
+
+    // bunnies are only counted in generated scenes
+    char bunnyColumn[BUFSIZ] = "-";
+    if(!options.sceneFile)
+      sprintf(bunnyColumn, "%d", options.Nbunnies);
+
+    if(rank==0)
+      printf("%9d %8s %10d %9.2f %9d %17.3f %14.3f %12d %15s\n",
+	     bodies->Nbodies, bunnyColumn, scene->Nshapes-bodies->Nbodies+scene->mesh->Nfaces,
+	     setupTime, NsubSteps, 1e3*physicsTime/max(NsubSteps,1),
+	     1e3*gridTime/Nframes, Nreinserted, renderColumn);
+
+    solverFree(solver);
+    broadphaseFree(sleeping);
+    broadphaseFree(awake);
+    sdfFree(sdf);
+    domainFree(domain);
+    bodiesFree(bodies);
+    sceneFree(scene);
+  }
+
+  outputFree(output);
+
+  free(img);
+  free(rowStarts);
+  free(rowCost);
+  free(randomNumbers);
+  free(sceneList);
+
+  MPI_Finalize();
+
+  return 0;
+}
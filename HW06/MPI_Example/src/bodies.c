@@ -0,0 +1,85 @@
+#include "simpleRayTracer.h"
+
+// structure of arrays store of the dynamic spheres
+// Notes:
+//
+// a. the physics works on contiguous x/y/z arrays so the per-body loops
+//    (integration, time step, distance tests) vectorise
+// b. sphere shapes keep a render copy of the position, speed and radius, and
+//    the index of their body, the copy is refreshed by domainGather before
+//    rendering (bodiesToShapes when every body is current, as in replay)
+// c. bodies are numbered in shape order
+
+bodies_t *bodiesSetup(const int Nshapes, shape_t *shapes){
+
+  bodies_t *bodies = (bodies_t*) calloc(1, sizeof(bodies_t));
+
+  bodies->Nbodies = 0;
+  for(int id=0;id<Nshapes;++id)
+    if(shapes[id].type==SPHERE)
+      ++(bodies->Nbodies);
+
+  const int Nbodies = bodies->Nbodies;
+
+  bodies->shapeIds  = (int*) calloc(Nbodies, sizeof(int));
+  bodies->x         = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->y         = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->z         = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->radius    = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->vx        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->vy        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->vz        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->nvx       = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->nvy       = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->nvz       = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->fx        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->fy        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->fz        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->contactCutoff = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  bodies->slowSteps = (int*) calloc(Nbodies, sizeof(int));
+  bodies->asleep    = (int*) calloc(Nbodies, sizeof(int));
+
+  // spheres start at rest
+  int b = 0;
+  for(int id=0;id<Nshapes;++id){
+    if(shapes[id].type==SPHERE){
+      sphere_t &sphere = shapes[id].sphere;
+      sphere.body = b;
+      sphere.speed = 0;
+
+      bodies->shapeIds[b] = id;
+      bodies->x[b] = sphere.pos.x;
+      bodies->y[b] = sphere.pos.y;
+      bodies->z[b] = sphere.pos.z;
+      bodies->radius[b] = sphere.radius;
+      ++b;
+    }
+  }
+
+  return bodies;
+}
+
+// copy body positions to the sphere shapes for rendering
+void bodiesToShapes(const bodies_t *bodies, shape_t *shapes){
+
+#pragma omp parallel for
+  for(int b=0;b<bodies->Nbodies;++b){
+    sphere_t &sphere = shapes[bodies->shapeIds[b]].sphere;
+    sphere.pos   = vectorCreate(bodies->x[b], bodies->y[b], bodies->z[b]);
+    sphere.speed = sqrt(bodies->vx[b]*bodies->vx[b] + bodies->vy[b]*bodies->vy[b] + bodies->vz[b]*bodies->vz[b]);
+  }
+}
+
+void bodiesFree(bodies_t *bodies){
+
+  free(bodies->shapeIds);
+  free(bodies->x);   free(bodies->y);   free(bodies->z);
+  free(bodies->radius);
+  free(bodies->vx);  free(bodies->vy);  free(bodies->vz);
+  free(bodies->nvx); free(bodies->nvy); free(bodies->nvz);
+  free(bodies->fx);  free(bodies->fy);  free(bodies->fz);
+  free(bodies->contactCutoff);
+  free(bodies->slowSteps);
+  free(bodies->asleep);
+  free(bodies);
+}
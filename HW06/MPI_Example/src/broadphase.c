@@ -0,0 +1,171 @@
+#include "simpleRayTracer.h"
+
+// hashed cell list of the bodies that are current on this rank
+// Notes:
+//
+// a. cells are cubes of side 2*maxRadius*(1+p_cfl), so two spheres that overlap
+//    or may meet within a substep are always in the same or in neighbouring cells
+// b. cells are hashed into Nbuckets buckets, the bodies are sorted into
+//    buckets with a counting sort (same count/scan/fill as gridPopulate)
+// c. different cells can share a bucket, so candidates must be distance checked
+//    and may be visited more than once
+// d. awake and sleeping bodies are kept in separate broadphases, the sleeping
+//    one is only rebuilt when the set of current sleeping bodies changes
+// e. positions and radii are copied in bucket order so the distance tests of
+//    broadphaseOverlaps run over contiguous arrays
+
+broadphase_t *broadphaseSetup(const bodies_t *bodies, const int sleeping){
+
+  broadphase_t *broadphase = (broadphase_t*) calloc(1, sizeof(broadphase_t));
+
+  broadphase->sleeping = sleeping;
+
+  const int Nbodies = bodies->Nbodies;
+
+  dfloat maxRadius = 0;
+  for(int b=0;b<Nbodies;++b)
+    maxRadius = max(maxRadius, bodies->radius[b]);
+
+  broadphase->cellSize = 2*maxRadius*(1+p_cfl);
+  broadphase->invCellSize = 1./broadphase->cellSize;
+
+  // power of two buckets, about two per body
+  broadphase->Nbuckets = 1;
+  while(broadphase->Nbuckets<2*Nbodies)
+    broadphase->Nbuckets *= 2;
+
+  broadphase->bucketStarts   = (int*) calloc(broadphase->Nbuckets+1, sizeof(int));
+  broadphase->bucketCounts   = (int*) calloc(broadphase->Nbuckets+1, sizeof(int));
+  broadphase->bucketContents = (int*) calloc(Nbodies, sizeof(int));
+  broadphase->sortedX        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  broadphase->sortedY        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  broadphase->sortedZ        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  broadphase->sortedR        = (dfloat*) calloc(Nbodies, sizeof(dfloat));
+  broadphase->localIds       = (int*) calloc(Nbodies, sizeof(int));
+  broadphase->bodyBuckets    = (int*) calloc(Nbodies, sizeof(int));
+  broadphase->members        = (int*) calloc(Nbodies, sizeof(int));
+
+  return broadphase;
+}
+
+// cell containing coordinate x
+int broadphaseCell(const broadphase_t *broadphase, const dfloat x){
+
+  return (int) floor(x*broadphase->invCellSize);
+}
+
+// bucket of cell (i,j,k)
+int broadphaseBucket(const broadphase_t *broadphase, const int i, const int j, const int k){
+
+  const unsigned int h = (73856093u*(unsigned int)i) ^ (19349663u*(unsigned int)j) ^ (83492791u*(unsigned int)k);
+
+  return h & (broadphase->Nbuckets-1);
+}
+
+// sort the owned and halo bodies that are awake (or asleep) into buckets
+void broadphaseBuild(broadphase_t *broadphase, const domain_t *domain, const bodies_t *bodies){
+
+  const int Nbuckets = broadphase->Nbuckets;
+  const int Nbodies  = bodies->Nbodies;
+  int *counts = broadphase->bucketCounts;
+
+  // only bodies with current state on this rank and matching sleep state
+  int changed = 0;
+  for(int b=0;b<Nbodies;++b){
+    const int member = (domain->stamps[b]==domain->step) && (bodies->asleep[b]==broadphase->sleeping);
+    changed |= (member!=broadphase->members[b]);
+    broadphase->members[b] = member;
+  }
+
+  // sleeping bodies do not move
+  if(broadphase->sleeping && !changed)
+    return;
+
+  for(int b=0;b<=Nbuckets;++b)
+    counts[b] = 0;
+
+  // count bodies in each bucket
+  int Nlocal = 0;
+  for(int b=0;b<Nbodies;++b){
+    if(broadphase->members[b]){
+      const int bucket = broadphaseBucket(broadphase,
+					  broadphaseCell(broadphase, bodies->x[b]),
+					  broadphaseCell(broadphase, bodies->y[b]),
+					  broadphaseCell(broadphase, bodies->z[b]));
+      broadphase->localIds[Nlocal] = b;
+      broadphase->bodyBuckets[Nlocal] = bucket;
+      ++counts[bucket];
+      ++Nlocal;
+    }
+  }
+  broadphase->Nlocal = Nlocal;
+
+  // make cumulative count
+  gridScan(Nbuckets, counts, broadphase->bucketStarts);
+
+  // use counts as running insertion point of each bucket
+  memcpy(counts, broadphase->bucketStarts, (Nbuckets+1)*sizeof(int));
+
+  for(int n=0;n<Nlocal;++n){
+    const int b = broadphase->localIds[n];
+    const int offset = counts[broadphase->bodyBuckets[n]]++;
+    broadphase->bucketContents[offset] = b;
+    broadphase->sortedX[offset] = bodies->x[b];
+    broadphase->sortedY[offset] = bodies->y[b];
+    broadphase->sortedZ[offset] = bodies->z[b];
+    broadphase->sortedR[offset] = bodies->radius[b];
+  }
+}
+
+// bodies in a bucket that overlap the sphere at (x,y,z) with radius r, returns
+// the number of hits (at most maxNhits, may include the sphere itself)
+int broadphaseOverlaps(const broadphase_t *broadphase, const int bucket,
+		       const dfloat x, const dfloat y, const dfloat z, const dfloat r,
+		       const int maxNhits, int *hits){
+
+  const int start = broadphase->bucketStarts[bucket];
+  const int   end = broadphase->bucketStarts[bucket+1];
+
+  const dfloat *sx = broadphase->sortedX;
+  const dfloat *sy = broadphase->sortedY;
+  const dfloat *sz = broadphase->sortedZ;
+  const dfloat *sr = broadphase->sortedR;
+
+  int Nhits = 0;
+
+  // test p_simdWidth bodies at a time, then compact the hits
+  for(int base=start;base<end && Nhits<maxNhits;base+=p_simdWidth){
+    const int len = min(p_simdWidth, end-base);
+    int overlap[p_simdWidth];
+
+#pragma omp simd
+    for(int l=0;l<len;++l){
+      const dfloat dx = sx[base+l]-x;
+      const dfloat dy = sy[base+l]-y;
+      const dfloat dz = sz[base+l]-z;
+      const dfloat R  = sr[base+l]+r;
+      overlap[l] = (dx*dx+dy*dy+dz*dz < R*R);
+    }
+
+    for(int l=0;l<len && Nhits<maxNhits;++l)
+      if(overlap[l])
+	hits[Nhits++] = broadphase->bucketContents[base+l];
+  }
+
+  return Nhits;
+}
+
+void broadphaseFree(broadphase_t *broadphase){
+
+  free(broadphase->bucketStarts);
+  free(broadphase->bucketCounts);
+  free(broadphase->bucketContents);
+  free(broadphase->sortedX);
+  free(broadphase->sortedY);
+  free(broadphase->sortedZ);
+  free(broadphase->sortedR);
+  free(broadphase->localIds);
+  free(broadphase->bodyBuckets);
+  free(broadphase->members);
+  free(broadphase);
+}
@@ -0,0 +1,219 @@
+#include "simpleRayTracer.h"
+
+// capture of the rays traced in a frame, replayed by the replay driver
+// Notes:
+//
+// a. every thread appends to its own buffer, the records of a rank are in
+//    the order its threads happened to take the rows so only the set of
+//    records of a capture is reproducible
+// b. the file is a captureHeader_t, the packets of all bodies and the records,
+//    rank 0 writes the header and the packets collected from the owners of the
+//    bodies, every rank writes its records collectively after those of the
+//    ranks before it
+// c. the header keeps the hash of the scene inputs (see sceneCacheSetup), a
+//    capture only replays in the scene it was traced in
+// d. each record keeps the result of its search so a replay can check that
+//    another intersection engine finds the same hits
+
+capture_t *captureSetup(const int every){
+
+  capture_t *capture = (capture_t*) calloc(1, sizeof(capture_t));
+
+  capture->every    = max(every, 1);
+  capture->Nthreads = omp_get_max_threads();
+  capture->Nrays    = (size_t*) calloc(capture->Nthreads, sizeof(size_t));
+  capture->maxNrays = (size_t*) calloc(capture->Nthreads, sizeof(size_t));
+  capture->rays     = (rayRecord_t**) calloc(capture->Nthreads, sizeof(rayRecord_t*));
+
+  return capture;
+}
+
+// record ray r and the result of its intersection search (called by any thread)
+void captureRay(capture_t *capture, const ray_t &r, const int kind, const dfloat t, const int shape){
+
+  const int thread = omp_get_thread_num();
+
+  size_t &N = capture->Nrays[thread];
+  if(N==capture->maxNrays[thread]){
+    capture->maxNrays[thread] = max(2*N, (size_t)BUFSIZ);
+    capture->rays[thread] =
+      (rayRecord_t*) realloc(capture->rays[thread], capture->maxNrays[thread]*sizeof(rayRecord_t));
+  }
+
+  rayRecord_t &record = capture->rays[thread][N++];
+  memset(&record, 0, sizeof(rayRecord_t));
+  record.start = r.start;
+  record.dir   = r.dir;
+  record.t     = (shape==-1) ? 0 : t;
+  record.shape = shape;
+  record.level = r.level;
+  record.kind  = kind;
+}
+
+static void captureLayouts(int *layouts){
+
+  layouts[0] = sizeof(dfloat);
+  layouts[1] = sizeof(bodyPacket_t);
+  layouts[2] = sizeof(rayRecord_t);
+}
+
+// collective: write the rays captured by all ranks in frame to fileName
+void captureSave(MPI_Comm comm, const char *fileName, const int frame, const uint64_t sceneHash,
+		 const bodies_t *bodies, const domain_t *domain, const capture_t *capture){
+
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  const int Nbodies = bodies->Nbodies;
+
+  // records of this rank in one buffer
+  long long int Nrays = 0;
+  for(int n=0;n<capture->Nthreads;++n)
+    Nrays += capture->Nrays[n];
+
+  rayRecord_t *rays = (rayRecord_t*) malloc(max(Nrays, 1LL)*sizeof(rayRecord_t));
+  rayRecord_t *c = rays;
+  for(int n=0;n<capture->Nthreads;++n){
+    memcpy(c, capture->rays[n], capture->Nrays[n]*sizeof(rayRecord_t));
+    c += capture->Nrays[n];
+  }
+
+  long long int raysBefore = 0, NraysTotal = 0;
+  MPI_Exscan(&Nrays, &raysBefore, 1, MPI_LONG_LONG_INT, MPI_SUM, comm);
+  if(rank==0) raysBefore = 0; // MPI_Exscan leaves rank 0 undefined
+  MPI_Allreduce(&Nrays, &NraysTotal, 1, MPI_LONG_LONG_INT, MPI_SUM, comm);
+
+  const MPI_Offset packetsStart = sizeof(captureHeader_t);
+  const MPI_Offset raysStart    = packetsStart + (MPI_Offset)Nbodies*sizeof(bodyPacket_t);
+
+  MPI_File fh;
+  if(MPI_File_open(comm, fileName, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+    if(rank==0)
+      printf("captureSave: could not open %s, no rays written\n", fileName);
+    free(rays);
+    return;
+  }
+
+  MPI_File_set_size(fh, 0);
+
+  // bodies have not moved since the frame was gathered for rendering
+  bodyPacket_t *packets = (rank==0) ? (bodyPacket_t*) calloc(Nbodies, sizeof(bodyPacket_t)) : NULL;
+  domainGatherState(domain, bodies, packets);
+
+  if(rank==0){
+    captureHeader_t header;
+    memset(&header, 0, sizeof(captureHeader_t));
+    memcpy(header.magic, "SRTRAYS", 8);
+    header.version = p_captureVersion;
+    captureLayouts(header.layouts);
+    header.frame   = frame;
+    header.Nbodies = Nbodies;
+    header.Nrays   = NraysTotal;
+    header.sceneHash = sceneHash;
+
+    MPI_File_write_at(fh, 0, &header, sizeof(captureHeader_t), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, packetsStart, packets, Nbodies*sizeof(bodyPacket_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    free(packets);
+  }
+
+  // in pieces of at most 2^30 bytes (MPI counts are ints)
+  const long long int piece = (1<<30)/sizeof(rayRecord_t);
+  long long int Npieces = (Nrays+piece-1)/piece;
+  MPI_Allreduce(MPI_IN_PLACE, &Npieces, 1, MPI_LONG_LONG_INT, MPI_MAX, comm);
+
+  for(long long int p=0;p<Npieces;++p){
+    const long long int start = min(p*piece, Nrays);
+    const long long int N     = min(piece, Nrays-start);
+    MPI_File_write_at_all(fh, raysStart + (raysBefore+start)*(MPI_Offset)sizeof(rayRecord_t),
+			  rays+start, N*sizeof(rayRecord_t), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+
+  MPI_File_close(&fh);
+
+  if(rank==0)
+    printf("captured %lld rays of frame %d in %s\n", NraysTotal, frame, fileName);
+
+  free(rays);
+}
+
+// collective: read the sphere state of a capture into bodies and return the
+// records of this rank's share of the rays (frame and the number of records
+// returned are set)
+rayRecord_t *captureLoad(MPI_Comm comm, const char *fileName, const uint64_t sceneHash, bodies_t *bodies,
+			 int *frame, int64_t *Nrays){
+
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  MPI_File fh;
+  if(MPI_File_open(comm, fileName, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+    if(rank==0)
+      printf("captureLoad: could not open %s\n", fileName);
+    MPI_Abort(comm, 1);
+  }
+
+  captureHeader_t header;
+  MPI_File_read_at_all(fh, 0, &header, sizeof(captureHeader_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  int layouts[3];
+  captureLayouts(layouts);
+
+  if(memcmp(header.magic, "SRTRAYS", 8) || header.version!=p_captureVersion ||
+     memcmp(header.layouts, layouts, sizeof(layouts)) ||
+     header.Nbodies!=bodies->Nbodies || header.sceneHash!=sceneHash){
+    if(rank==0)
+      printf("captureLoad: %s is not a ray capture of this build and scene\n", fileName);
+    MPI_Abort(comm, 1);
+  }
+
+  const int Nbodies = bodies->Nbodies;
+
+  const MPI_Offset packetsStart = sizeof(captureHeader_t);
+  const MPI_Offset raysStart    = packetsStart + (MPI_Offset)Nbodies*sizeof(bodyPacket_t);
+
+  bodyPacket_t *packets = (bodyPacket_t*) calloc(max(Nbodies, 1), sizeof(bodyPacket_t));
+  MPI_File_read_at_all(fh, packetsStart, packets, Nbodies*sizeof(bodyPacket_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  for(int b=0;b<Nbodies;++b)
+    domainUnpackBody(packets[b], bodies);
+
+  free(packets);
+
+  // equal shares of the records
+  const long long int start = (header.Nrays*rank)/size;
+  const long long int end   = (header.Nrays*(rank+1))/size;
+  const long long int N     = end-start;
+
+  rayRecord_t *rays = (rayRecord_t*) malloc(max(N, 1LL)*sizeof(rayRecord_t));
+
+  const long long int piece = (1<<30)/sizeof(rayRecord_t);
+  long long int Npieces = (N+piece-1)/piece;
+  MPI_Allreduce(MPI_IN_PLACE, &Npieces, 1, MPI_LONG_LONG_INT, MPI_MAX, comm);
+
+  for(long long int p=0;p<Npieces;++p){
+    const long long int pieceStart = min(p*piece, N);
+    const long long int pieceN     = min(piece, N-pieceStart);
+    MPI_File_read_at_all(fh, raysStart + (start+pieceStart)*(MPI_Offset)sizeof(rayRecord_t),
+			 rays+pieceStart, pieceN*sizeof(rayRecord_t), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+
+  MPI_File_close(&fh);
+
+  *frame = header.frame;
+  *Nrays = N;
+
+  return rays;
+}
+
+void captureFree(capture_t *capture){
+
+  for(int n=0;n<capture->Nthreads;++n)
+    free(capture->rays[n]);
+
+  free(capture->rays);
+  free(capture->Nrays);
+  free(capture->maxNrays);
+  free(capture);
+}
@@ -0,0 +1,233 @@
+#include "simpleRayTracer.h"
+
+// checkpoints of the sphere state between frames
+// Notes:
+//
+// a. taken at the start of a frame, the state of every body is collected from
+//    its owner on rank 0 (see domainGatherState)
+// b. the file is a checkpointHeader_t, the packets of all bodies (written by
+//    rank 0), the file offsets of one section per rank (Nranks+1 of them) and
+//    the sections, each rank writes its own section collectively:
+//      int Nowned, int owned[Nowned]           the owned bodies in order
+//      int Ncached, Ncached times:
+//        int body, int N, contact_t[N]         its non empty contact caches
+// c. restarting on the same number of ranks restores the ownership and the
+//    warm start contacts so the frames that follow are the same as those of
+//    an uninterrupted run, on another number of ranks bodies are owned by
+//    position and the contact solver starts cold
+// d. the file is written under a temporary name and renamed once complete
+// e. the header keeps the hash of the scene inputs (see sceneCacheSetup), a
+//    checkpoint only restarts the scene it was taken from
+
+// append bytes to a section buffer
+static unsigned char *checkpointPut(unsigned char *c, const void *data, const size_t bytes){
+
+  memcpy(c, data, bytes);
+
+  return c + bytes;
+}
+
+// read bytes from a section buffer
+static const unsigned char *checkpointGet(const unsigned char *c, void *data, const size_t bytes){
+
+  memcpy(data, c, bytes);
+
+  return c + bytes;
+}
+
+static void checkpointLayouts(int *layouts){
+
+  layouts[0] = sizeof(dfloat);
+  layouts[1] = sizeof(bodyPacket_t);
+  layouts[2] = sizeof(contact_t);
+  layouts[3] = p_maxNcontacts;
+}
+
+// collective: write the state of all bodies before frame to fileName
+void checkpointSave(MPI_Comm comm, const char *fileName, const int frame, const uint64_t sceneHash,
+		    const bodies_t *bodies, const domain_t *domain, const solver_t *solver){
+
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  const int Nbodies = bodies->Nbodies;
+
+  // section of this rank
+  int Ncached = 0;
+  size_t bytes = (2 + domain->Nowned)*sizeof(int);
+  for(int b=0;b<Nbodies;++b){
+    if(solver->Ncontacts[b]){
+      ++Ncached;
+      bytes += 2*sizeof(int) + solver->Ncontacts[b]*sizeof(contact_t);
+    }
+  }
+
+  unsigned char *section = (unsigned char*) malloc(bytes);
+  unsigned char *c = section;
+  c = checkpointPut(c, &(domain->Nowned), sizeof(int));
+  c = checkpointPut(c, domain->owned, domain->Nowned*sizeof(int));
+  c = checkpointPut(c, &Ncached, sizeof(int));
+  for(int b=0;b<Nbodies;++b){
+    const int N = solver->Ncontacts[b];
+    if(N){
+      c = checkpointPut(c, &b, sizeof(int));
+      c = checkpointPut(c, &N, sizeof(int));
+      c = checkpointPut(c, solverContacts(solver, b), N*sizeof(contact_t));
+    }
+  }
+
+  // sections follow the header, the packets and the section offsets
+  const MPI_Offset packetsStart  = sizeof(checkpointHeader_t);
+  const MPI_Offset offsetsStart  = packetsStart + (MPI_Offset)Nbodies*sizeof(bodyPacket_t);
+  const MPI_Offset sectionsStart = offsetsStart + (size+1)*sizeof(int64_t);
+
+  long long int myBytes = bytes, offset = 0;
+  MPI_Exscan(&myBytes, &offset, 1, MPI_LONG_LONG_INT, MPI_SUM, comm);
+  if(rank==0) offset = 0; // MPI_Exscan leaves rank 0 undefined
+
+  int64_t *offsets = (int64_t*) calloc(size+1, sizeof(int64_t));
+  int64_t myOffset = sectionsStart + offset;
+  MPI_Gather(&myOffset, 1, MPI_INT64_T, offsets, 1, MPI_INT64_T, 0, comm);
+
+  char tmpName[BUFSIZ];
+  snprintf(tmpName, BUFSIZ, "%s.tmp", fileName);
+
+  MPI_File fh;
+  if(MPI_File_open(comm, tmpName, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+    if(rank==0)
+      printf("checkpointSave: could not open %s, no checkpoint written\n", tmpName);
+    free(section);
+    free(offsets);
+    return;
+  }
+
+  MPI_File_set_size(fh, 0);
+
+  bodyPacket_t *packets = (rank==0) ? (bodyPacket_t*) calloc(Nbodies, sizeof(bodyPacket_t)) : NULL;
+  domainGatherState(domain, bodies, packets);
+
+  if(rank==0){
+    checkpointHeader_t header;
+    memset(&header, 0, sizeof(checkpointHeader_t));
+    memcpy(header.magic, "SRTCHECK", 8);
+    header.version = p_checkpointVersion;
+    checkpointLayouts(header.layouts);
+    header.frame   = frame;
+    header.Nbodies = Nbodies;
+    header.Nranks  = size;
+    header.sceneHash = sceneHash;
+
+    MPI_File_write_at(fh, 0, &header, sizeof(checkpointHeader_t), MPI_BYTE, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, packetsStart, packets, Nbodies*sizeof(bodyPacket_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+    free(packets);
+  }
+
+  // end of the last section
+  int64_t end = myOffset + bytes;
+  MPI_Reduce(rank==0 ? MPI_IN_PLACE : &end, &end, 1, MPI_INT64_T, MPI_MAX, 0, comm);
+  if(rank==0){
+    offsets[size] = end;
+    MPI_File_write_at(fh, offsetsStart, offsets, (size+1)*sizeof(int64_t), MPI_BYTE, MPI_STATUS_IGNORE);
+  }
+
+  MPI_File_write_at_all(fh, myOffset, section, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+
+  MPI_File_close(&fh);
+
+  if(rank==0 && rename(tmpName, fileName))
+    printf("checkpointSave: could not rename %s to %s\n", tmpName, fileName);
+
+  free(section);
+  free(offsets);
+}
+
+// collective: restore the state of all bodies from fileName, returns the frame to start from
+int checkpointLoad(MPI_Comm comm, const char *fileName, const uint64_t sceneHash,
+		   bodies_t *bodies, domain_t *domain, solver_t *solver){
+
+  int rank, size;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &size);
+
+  MPI_File fh;
+  if(MPI_File_open(comm, fileName, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)!=MPI_SUCCESS){
+    if(rank==0)
+      printf("checkpointLoad: could not open %s\n", fileName);
+    MPI_Abort(comm, 1);
+  }
+
+  checkpointHeader_t header;
+  MPI_File_read_at_all(fh, 0, &header, sizeof(checkpointHeader_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  int layouts[4];
+  checkpointLayouts(layouts);
+
+  if(memcmp(header.magic, "SRTCHECK", 8) || header.version!=p_checkpointVersion ||
+     memcmp(header.layouts, layouts, sizeof(layouts)) ||
+     header.Nbodies!=bodies->Nbodies || header.Nranks<1 || header.sceneHash!=sceneHash){
+    if(rank==0)
+      printf("checkpointLoad: %s is not a checkpoint of this build and scene\n", fileName);
+    MPI_Abort(comm, 1);
+  }
+
+  const int Nbodies = bodies->Nbodies;
+  const int Nranks  = header.Nranks;
+
+  const MPI_Offset packetsStart = sizeof(checkpointHeader_t);
+  const MPI_Offset offsetsStart = packetsStart + (MPI_Offset)Nbodies*sizeof(bodyPacket_t);
+
+  bodyPacket_t *packets = (bodyPacket_t*) calloc(Nbodies, sizeof(bodyPacket_t));
+  MPI_File_read_at_all(fh, packetsStart, packets, Nbodies*sizeof(bodyPacket_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  for(int b=0;b<Nbodies;++b)
+    domainUnpackBody(packets[b], bodies);
+
+  free(packets);
+
+  int64_t *offsets = (int64_t*) calloc(Nranks+1, sizeof(int64_t));
+  MPI_File_read_at_all(fh, offsetsStart, offsets, (Nranks+1)*sizeof(int64_t), MPI_BYTE, MPI_STATUS_IGNORE);
+
+  // every body is current on every rank
+  ++(domain->step);
+
+  for(int b=0;b<Nbodies;++b)
+    solver->Ncontacts[b] = 0;
+
+  if(Nranks==size){
+    const size_t bytes = offsets[rank+1] - offsets[rank];
+    unsigned char *section = (unsigned char*) malloc(bytes);
+    MPI_File_read_at_all(fh, offsets[rank], section, bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+
+    const unsigned char *c = section;
+    c = checkpointGet(c, &(domain->Nowned), sizeof(int));
+    c = checkpointGet(c, domain->owned, domain->Nowned*sizeof(int));
+
+    for(int b=0;b<Nbodies;++b)
+      domain->stamps[b] = domain->step;
+
+    int Ncached;
+    c = checkpointGet(c, &Ncached, sizeof(int));
+    for(int n=0;n<Ncached;++n){
+      int b, N;
+      c = checkpointGet(c, &b, sizeof(int));
+      c = checkpointGet(c, &N, sizeof(int));
+      c = checkpointGet(c, solverContacts(solver, b), N*sizeof(contact_t));
+      solver->Ncontacts[b] = N;
+    }
+
+    free(section);
+  }
+  else{
+    if(rank==0)
+      printf("checkpointLoad: %s was written by %d ranks, contacts start cold\n", fileName, Nranks);
+    domainClaim(domain, bodies);
+  }
+
+  MPI_File_close(&fh);
+
+  free(offsets);
+
+  return header.frame;
+}
@@ -0,0 +1,304 @@
+#include "simpleRayTracer.h"
+
+// slab decomposition of the sphere physics
+// Notes:
+//
+// a. rank r owns the x-slab covering grid cells [r*NI/Nslabs, (r+1)*NI/Nslabs)
+// b. the first and last slab extend to infinity so no body is ever lost
+// c. halos only reach the neighbouring slabs, so inner slabs must be at least
+//    a halo wide: with too many ranks only the first Nslabs ranks get a slab
+//    and the others own no bodies (they still render)
+// d. every rank keeps a full copy of the bodies, but only the state of owned
+//    bodies and of halo bodies received this substep is current
+// e. the physics arrays and the gather before each frame are still sized by
+//    the total body count, not by the slab: domainGather sends only positions
+//    and speeds into the render copy, which every rank needs to render the
+//    whole scene, and domainGatherState moves the full state of all bodies to
+//    rank 0 only for checkpoints and captures
+
+domain_t *domainSetup(MPI_Comm comm, const grid_t *grid, const bodies_t *bodies){
+
+  domain_t *domain = (domain_t*) calloc(1, sizeof(domain_t));
+
+  domain->comm = comm;
+  MPI_Comm_rank(comm, &(domain->rank));
+  MPI_Comm_size(comm, &(domain->size));
+
+  const int rank = domain->rank;
+  const int size = domain->size;
+
+  domain->Nbodies = bodies->Nbodies;
+
+  dfloat maxRadius = 0;
+  for(int b=0;b<bodies->Nbodies;++b)
+    maxRadius = max(maxRadius, bodies->radius[b]);
+
+  domain->owned  = (int*) calloc(domain->Nbodies, sizeof(int));
+  domain->stamps = (int*) calloc(domain->Nbodies, sizeof(int));
+
+  // a sphere can collide with any sphere whose bbox touches a cell its own bbox touches,
+  // or that either of them can reach within a substep
+  domain->haloWidth = 2*maxRadius*(1+p_cfl) + 2*grid->dx;
+
+  // the inner slabs (narrowest has NI/Nslabs cells) must be at least a halo wide
+  int Nslabs = size;
+  while(Nslabs>2 && grid->dx*(grid->NI/Nslabs) < domain->haloWidth)
+    --Nslabs;
+  domain->Nslabs = Nslabs;
+
+  if(rank==0 && Nslabs<size)
+    printf("domainSetup: slabs of %d ranks would be narrower than the halo width %g, physics uses %d ranks\n",
+	   size, domain->haloWidth, Nslabs);
+
+  domain->left  = (rank>0 && rank<Nslabs) ? rank-1 : MPI_PROC_NULL;
+  domain->right = (rank<Nslabs-1)         ? rank+1 : MPI_PROC_NULL;
+
+  // slab boundaries are aligned with grid cells
+  domain->xmin = grid->xmin + grid->dx*((rank  )*grid->NI/Nslabs);
+  domain->xmax = grid->xmin + grid->dx*((rank+1)*grid->NI/Nslabs);
+  if(rank==0)        domain->xmin = -1e9;
+  if(rank==Nslabs-1) domain->xmax =  1e9;
+
+  // ranks without a slab own nothing
+  if(rank>=Nslabs){
+    domain->xmin = 1e9;
+    domain->xmax = 1e9;
+  }
+
+  // initial state is identical on all ranks so every body is current
+  domain->step = 0;
+  domainClaim(domain, bodies);
+
+  // buffers for halo exchange, large enough for every body
+  domain->leftBuffer  = (bodyPacket_t*) calloc(domain->Nbodies, sizeof(bodyPacket_t));
+  domain->rightBuffer = (bodyPacket_t*) calloc(domain->Nbodies, sizeof(bodyPacket_t));
+  domain->recvBuffer  = (bodyPacket_t*) calloc(domain->Nbodies, sizeof(bodyPacket_t));
+  domain->recvCounts  = (int*) calloc(size, sizeof(int));
+  domain->recvOffsets = (int*) calloc(size, sizeof(int));
+
+  // buffers for the render copy
+  domain->renderSend  = (renderPacket_t*) calloc(domain->Nbodies, sizeof(renderPacket_t));
+  domain->renderRecv  = (renderPacket_t*) calloc(domain->Nbodies, sizeof(renderPacket_t));
+
+  MPI_Type_contiguous(sizeof(bodyPacket_t), MPI_BYTE, &(domain->MPI_BODY_PACKET));
+  MPI_Type_commit(&(domain->MPI_BODY_PACKET));
+
+  MPI_Type_contiguous(sizeof(renderPacket_t), MPI_BYTE, &(domain->MPI_RENDER_PACKET));
+  MPI_Type_commit(&(domain->MPI_RENDER_PACKET));
+
+  return domain;
+}
+
+// own the bodies whose state is current on every rank and whose centre is in this slab
+void domainClaim(domain_t *domain, const bodies_t *bodies){
+
+  domain->Nowned = 0;
+  for(int b=0;b<domain->Nbodies;++b){
+    const dfloat x = bodies->x[b];
+    if(x>=domain->xmin && x<domain->xmax)
+      domain->owned[domain->Nowned++] = b;
+    domain->stamps[b] = domain->step;
+  }
+}
+
+// copy the state of body b into a packet
+void domainPackBody(const bodies_t *bodies, const int b, bodyPacket_t &packet){
+
+  packet.body      = b;
+  packet.slowSteps = bodies->slowSteps[b];
+  packet.asleep    = bodies->asleep[b];
+  packet.x   = bodies->x[b];   packet.y   = bodies->y[b];   packet.z   = bodies->z[b];
+  packet.vx  = bodies->vx[b];  packet.vy  = bodies->vy[b];  packet.vz  = bodies->vz[b];
+  packet.nvx = bodies->nvx[b]; packet.nvy = bodies->nvy[b]; packet.nvz = bodies->nvz[b];
+  packet.fx  = bodies->fx[b];  packet.fy  = bodies->fy[b];  packet.fz  = bodies->fz[b];
+  packet.contactCutoff = bodies->contactCutoff[b];
+}
+
+// pack owned bodies with centre x in [xlo, xhi)
+static int domainPack(const domain_t *domain, const bodies_t *bodies,
+		      const dfloat xlo, const dfloat xhi, bodyPacket_t *packets){
+
+  int Npackets = 0;
+  for(int n=0;n<domain->Nowned;++n){
+    const int b = domain->owned[n];
+    const dfloat x = bodies->x[b];
+    if(x>=xlo && x<xhi)
+      domainPackBody(bodies, b, packets[Npackets++]);
+  }
+
+  return Npackets;
+}
+
+// copy one packet into the bodies
+void domainUnpackBody(const bodyPacket_t &packet, bodies_t *bodies){
+
+  const int b = packet.body;
+  bodies->slowSteps[b] = packet.slowSteps;
+  bodies->asleep[b]    = packet.asleep;
+  bodies->x[b]   = packet.x;   bodies->y[b]   = packet.y;   bodies->z[b]   = packet.z;
+  bodies->vx[b]  = packet.vx;  bodies->vy[b]  = packet.vy;  bodies->vz[b]  = packet.vz;
+  bodies->nvx[b] = packet.nvx; bodies->nvy[b] = packet.nvy; bodies->nvz[b] = packet.nvz;
+  bodies->fx[b]  = packet.fx;  bodies->fy[b]  = packet.fy;  bodies->fz[b]  = packet.fz;
+  bodies->contactCutoff[b] = packet.contactCutoff;
+}
+
+// swap packets with the neighbours, returns number of packets received
+static int domainSendRecv(domain_t *domain,
+			  const int Nsend, const bodyPacket_t *sendBuffer, const int dest,
+			  const int source){
+
+  int Nrecv = 0;
+
+  MPI_Sendrecv(&Nsend, 1, MPI_INT, dest, 0,
+	       &Nrecv, 1, MPI_INT, source, 0,
+	       domain->comm, MPI_STATUS_IGNORE);
+
+  MPI_Sendrecv(sendBuffer, Nsend, domain->MPI_BODY_PACKET, dest, 1,
+	       domain->recvBuffer, Nrecv, domain->MPI_BODY_PACKET, source, 1,
+	       domain->comm, MPI_STATUS_IGNORE);
+
+  return Nrecv;
+}
+
+// copy received bodies and (if adopt) take ownership of the ones that now lie
+// in this slab
+static void domainUnpack(domain_t *domain, const int Nrecv, const int adopt, bodies_t *bodies){
+
+  for(int n=0;n<Nrecv;++n){
+    const bodyPacket_t &packet = domain->recvBuffer[n];
+    domainUnpackBody(packet, bodies);
+    domain->stamps[packet.body] = domain->step;
+
+    const dfloat x = packet.x;
+    if(adopt && x>=domain->xmin && x<domain->xmax)
+      domain->owned[domain->Nowned++] = packet.body;
+  }
+}
+
+// send bodies near the slab edges to the neighbouring ranks, and migrate
+// bodies that have left the slab to their new owner
+void domainHaloExchange(domain_t *domain, bodies_t *bodies){
+
+  const dfloat xmin = domain->xmin;
+  const dfloat xmax = domain->xmax;
+  const dfloat halo = domain->haloWidth;
+
+  ++(domain->step);
+
+  // bodies that left the slab are included since they lie beyond the slab edge
+  int NsendLeft  = domainPack(domain, bodies,     -1e9, xmin+halo, domain->leftBuffer);
+  int NsendRight = domainPack(domain, bodies, xmax-halo,      1e9, domain->rightBuffer);
+
+  // keep owned bodies that are still in this slab
+  int Nowned = 0;
+  for(int n=0;n<domain->Nowned;++n){
+    const int b = domain->owned[n];
+    const dfloat x = bodies->x[b];
+    if(x>=xmin && x<xmax){
+      domain->owned[Nowned++] = b;
+      domain->stamps[b] = domain->step;
+    }
+  }
+  domain->Nowned = Nowned;
+
+  // send left, receive from right
+  int Nrecv = domainSendRecv(domain, NsendLeft, domain->leftBuffer, domain->left, domain->right);
+  domainUnpack(domain, Nrecv, 1, bodies);
+
+  // send right, receive from left
+  Nrecv = domainSendRecv(domain, NsendRight, domain->rightBuffer, domain->right, domain->left);
+  domainUnpack(domain, Nrecv, 1, bodies);
+}
+
+// resend the owned bodies near the slab edges without moving them between
+// ranks (used within a substep after owned body states change)
+void domainHaloRefresh(domain_t *domain, bodies_t *bodies){
+
+  const dfloat halo = domain->haloWidth;
+
+  int NsendLeft  = domainPack(domain, bodies,     -1e9, domain->xmin+halo, domain->leftBuffer);
+  int NsendRight = domainPack(domain, bodies, domain->xmax-halo,      1e9, domain->rightBuffer);
+
+  int Nrecv = domainSendRecv(domain, NsendLeft, domain->leftBuffer, domain->left, domain->right);
+  domainUnpack(domain, Nrecv, 0, bodies);
+
+  Nrecv = domainSendRecv(domain, NsendRight, domain->rightBuffer, domain->right, domain->left);
+  domainUnpack(domain, Nrecv, 0, bodies);
+}
+
+// counts and offsets of the packets gathered from each rank, returns the total
+static int domainGatherCounts(const domain_t *domain, const int Nsend){
+
+  MPI_Allgather(&Nsend, 1, MPI_INT, domain->recvCounts, 1, MPI_INT, domain->comm);
+
+  int Nrecv = 0;
+  for(int r=0;r<domain->size;++r){
+    domain->recvOffsets[r] = Nrecv;
+    Nrecv += domain->recvCounts[r];
+  }
+
+  return Nrecv;
+}
+
+// collect the positions and speeds of all bodies into the render copy on all
+// ranks (needed before rendering), the physics state of bodies owned by other
+// ranks is left as it is
+void domainGather(domain_t *domain, const bodies_t *bodies, shape_t *shapes){
+
+  const int Nsend = domain->Nowned;
+  for(int n=0;n<Nsend;++n){
+    const int b = domain->owned[n];
+    renderPacket_t &packet = domain->renderSend[n];
+    packet.body  = b;
+    packet.x = bodies->x[b]; packet.y = bodies->y[b]; packet.z = bodies->z[b];
+    packet.speed = sqrt(bodies->vx[b]*bodies->vx[b] + bodies->vy[b]*bodies->vy[b] + bodies->vz[b]*bodies->vz[b]);
+  }
+
+  const int Nrecv = domainGatherCounts(domain, Nsend);
+
+  MPI_Allgatherv(domain->renderSend, Nsend, domain->MPI_RENDER_PACKET,
+		 domain->renderRecv, domain->recvCounts, domain->recvOffsets,
+		 domain->MPI_RENDER_PACKET, domain->comm);
+
+#pragma omp parallel for
+  for(int n=0;n<Nrecv;++n){
+    const renderPacket_t &packet = domain->renderRecv[n];
+    sphere_t &sphere = shapes[bodies->shapeIds[packet.body]].sphere;
+    sphere.pos   = vectorCreate(packet.x, packet.y, packet.z);
+    sphere.speed = packet.speed;
+  }
+}
+
+// collective: collect the state of all bodies on rank 0, packets[b] holds body b
+// there (packets is only used on rank 0)
+void domainGatherState(const domain_t *domain, const bodies_t *bodies, bodyPacket_t *packets){
+
+  int Nsend = domainPack(domain, bodies, -1e9, 1e9, domain->leftBuffer);
+
+  const int Nrecv = domainGatherCounts(domain, Nsend);
+
+  MPI_Gatherv(domain->leftBuffer, Nsend, domain->MPI_BODY_PACKET,
+	      domain->recvBuffer, domain->recvCounts, domain->recvOffsets,
+	      domain->MPI_BODY_PACKET, 0, domain->comm);
+
+  if(domain->rank==0)
+    for(int n=0;n<Nrecv;++n)
+      packets[domain->recvBuffer[n].body] = domain->recvBuffer[n];
+}
+
+void domainFree(domain_t *domain){
+
+  MPI_Type_free(&(domain->MPI_BODY_PACKET));
+  MPI_Type_free(&(domain->MPI_RENDER_PACKET));
+
+  free(domain->owned);
+  free(domain->stamps);
+  free(domain->leftBuffer);
+  free(domain->rightBuffer);
+  free(domain->recvBuffer);
+  free(domain->recvCounts);
+  free(domain->recvOffsets);
+  free(domain->renderSend);
+  free(domain->renderRecv);
+  free(domain);
+}
@@ -75,16 +75,26 @@ bool gridRayIntersectionSearch(const ray_t r,
     
     *t = 20000; // TW ?
 
-    int start = grid.boxStarts[cellID];
-    int end   = grid.boxStarts[cellID+1];
-    for(int offset=start;offset<end;++offset){
-      const int obj = grid.boxContents[offset];
-      const shape_t shape = shapes[obj];
-      if(intersectRayShape(r, shape, t)){
-	vector_t intersect = vectorAdd(r.start, vectorScale(*t, r.dir));
+    // mesh faces, static shapes, then spheres (listed in the cells of their fattened bounds,
+    // only hits inside this cell count so the extra cells do not change the result)
+    for(int part=0;part<3;++part){
+      const int *starts   = (part==0) ? grid.faceStarts   : (part==1) ? grid.boxStarts   : grid.sphereStarts;
+      const int *contents = (part==0) ? grid.faceContents : (part==1) ? grid.boxContents : grid.sphereContents;
+      if(!starts) continue;
+
+      int start = starts[cellID];
+      int end   = starts[cellID+1];
+      for(int offset=start;offset<end;++offset){
+	const int obj = contents[offset];
+	const bool hit = (part==0) ?
+	  intersectRayTriangle(r, meshTriangle(grid.mesh, obj), t) :
+	  intersectRayShape(r, shapes[obj], t);
+	if(hit){
+	  vector_t intersect = vectorAdd(r.start, vectorScale(*t, r.dir));
 	
-	if(intersectPointGridCell(grid, intersect, cellI, cellJ, cellK)){
-	  *currentShape = obj;
+	  if(intersectPointGridCell(grid, intersect, cellI, cellJ, cellK)){
+	    *currentShape = (part==0) ? Nshapes+obj : obj;
+	  }
 	}
       }
     }
@@ -113,6 +123,8 @@ bool gridRayIntersectionSearch(const ray_t r,
   return false;
 }
 
+// trace ray r and the reflected, refracted and shadow rays it spawns, with a
+// capture (NULL for none) every intersection search is recorded with its result
 colour_t gridTrace(const grid_t grid,
 		   const int Nshapes,
 		   const shape_t *shapes,
@@ -123,7 +135,8 @@ colour_t gridTrace(const grid_t grid,
 		   ray_t  r,
 		   int    level,
 		   dfloat coef,
-		   colour_t bg){
+		   colour_t bg,
+		   capture_t *capture){
   
   colour_t black;
   black.red = 0;
@@ -135,12 +148,14 @@ colour_t gridTrace(const grid_t grid,
   
   int Nrays = 0, rayID = 0;
   ray_t rayStack[p_maxNrays];
+  int   rayKinds[p_maxNrays]; // CAPTURE_ kind of each ray on the stack
 
   // add initial ray to stack
   rayID = 0;
   r.level = 0;
   r.coef = coef;
   rayStack[Nrays] = r;
+  rayKinds[Nrays] = CAPTURE_PRIMARY;
   ++Nrays;
 
   // keep looping until the stack is exhausted or the maximum number of rays is reached
@@ -155,6 +170,9 @@ colour_t gridTrace(const grid_t grid,
 
     // look through grid to find intersections with ray
     gridRayIntersectionSearch(r, Nshapes, shapes, grid, &t, &currentShapeID);
+
+    if(capture)
+      captureRay(capture, r, rayKinds[rayID], t, currentShapeID);
     
     // none found
     if(currentShapeID == -1){
@@ -167,7 +185,7 @@ colour_t gridTrace(const grid_t grid,
     }
 
     // shape at nearest ray intersection
-    shape_t currentShape = shapes[currentShapeID];
+    shape_t currentShape = gridShape(grid, Nshapes, shapes, currentShapeID);
     
     // compute intersection location
     vector_t intersection = vectorAdd(r.start, vectorScale(t, r.dir));
@@ -224,6 +242,11 @@ colour_t gridTrace(const grid_t grid,
 	  int shadowShapeID = -1;
 	  gridRayIntersectionSearch(lightRay, Nshapes, shapes, grid, &tshadow, &shadowShapeID);
 
+	  if(capture){
+	    lightRay.level = r.level;
+	    captureRay(capture, lightRay, CAPTURE_SHADOW, tshadow, shadowShapeID);
+	  }
+
 	  // check for objects in path of shadow ray
 	  bool inShadow = false;	  
 	  if(shadowShapeID==-1) // no object causes shadow
@@ -255,6 +278,7 @@ colour_t gridTrace(const grid_t grid,
 	
 	  // launch new ray
 	  rayStack[Nrays] = reflectRay;
+	  rayKinds[Nrays] = CAPTURE_REFLECTED;
 	  // increment ray counter
 	  ++Nrays;
 	}
@@ -294,6 +318,7 @@ colour_t gridTrace(const grid_t grid,
 	    refractRay.level = r.level+1;
 	    refractRay.coef = r.coef; // ?
 	    rayStack[Nrays] = refractRay;
+	    rayKinds[Nrays] = CAPTURE_REFRACTED;
 	    ++Nrays;
 	  }
 	}
@@ -321,12 +346,13 @@ int gridScan(const int N, const int *v, int *scanv){
 }
 
 
-void gridCountShapesInCellsKernel(const grid_t grid, const int Nshapes, shape_t *shapes, int *counts){
+// ids lists the shapes to count (all shapes if ids is NULL)
+void gridCountShapesInCellsKernel(const grid_t grid, const int Nshapes, const int *ids, shape_t *shapes, int *counts){
 
   int N = Nshapes;
   for(int n=0;n<N;++n){
 
-    shape_t *shape = shapes+n;
+    shape_t *shape = shapes + (ids ? ids[n] : n);
     shape->bbox = createBoundingBoxShape(grid, *shape);
     
     const  int imin = shape->bbox.imin;
@@ -348,10 +374,10 @@ void gridCountShapesInCellsKernel(const grid_t grid, const int Nshapes, shape_t
 }
 
 
-void gridAddShapesInCellsKernel(const grid_t grid, const int Nshapes, const shape_t *shapes, int *boxCounters, int *boxContents){
+void gridAddShapesInCellsKernel(const grid_t grid, const int Nshapes, const int *ids, const shape_t *shapes, int *boxCounters, int *boxContents){
   
   for(int n=0;n<Nshapes;++n){
-    const shape_t *shape = shapes+n;
+    const shape_t *shape = shapes + (ids ? ids[n] : n);
 
     const  int imin = shape->bbox.imin;
     const  int imax = shape->bbox.imax;
@@ -376,7 +402,8 @@ void gridAddShapesInCellsKernel(const grid_t grid, const int Nshapes, const shap
   }
 }
 
-void gridPopulate(grid_t *grid, int Nshapes, shape_t *shapes){
+// populate grid with the shapes listed in ids (all shapes if ids is NULL)
+void gridPopulateShapes(grid_t *grid, int Nshapes, const int *ids, shape_t *shapes){
 
   if(grid->boxContents){
     free(grid->boxContents);
@@ -388,7 +415,7 @@ void gridPopulate(grid_t *grid, int Nshapes, shape_t *shapes){
 
   // count how many objects overlap each cell
   int *boxCounts  = (int*) calloc(Nboxes+1, sizeof(int));
-  gridCountShapesInCellsKernel (*grid, Nshapes, shapes, boxCounts);
+  gridCountShapesInCellsKernel (*grid, Nshapes, ids, shapes, boxCounts);
 
   // make cumulative count
   grid->boxStarts  = (int*) calloc(Nboxes+1, sizeof(int));  
@@ -402,9 +429,161 @@ void gridPopulate(grid_t *grid, int Nshapes, shape_t *shapes){
   grid->boxContents = (int*) calloc(Nentries, sizeof(int));
   
   // add each shape to every box that intersects the shape's bounding box
-  gridAddShapesInCellsKernel (*grid, Nshapes, shapes, boxCounters, grid->boxContents);
+  gridAddShapesInCellsKernel (*grid, Nshapes, ids, shapes, boxCounters, grid->boxContents);
 
   free(boxCounts);
   free(boxCounters);
   
 }
+
+// populate grid with the shapes that never move (everything except spheres)
+// and the mesh faces, the spheres are added by gridUpdateSpheres
+void gridPopulateStatic(grid_t *grid, const int Nshapes, shape_t *shapes, const mesh_t *mesh){
+
+  int *ids = (int*) calloc(Nshapes, sizeof(int));
+  int Nstatic = 0;
+  for(int n=0;n<Nshapes;++n)
+    if(shapes[n].type!=SPHERE)
+      ids[Nstatic++] = n;
+
+  gridPopulateShapes(grid, Nstatic, ids, shapes);
+
+  gridPopulateMesh(grid, mesh);
+
+  free(ids);
+}
+
+// cell range of the bounding box of a mesh face
+static bbox_t gridFaceBounds(const grid_t *grid, const mesh_t *mesh, const int face){
+
+  shape_t shape;
+  shape.type = TRIANGLE;
+  shape.triangle = meshTriangle(mesh, face);
+
+  return createBoundingBoxShape(*grid, shape);
+}
+
+// list the mesh faces in the cells their bounding boxes touch
+// Notes:
+//
+// a. face bounds are recomputed from the vertex buffer instead of being stored,
+//    the faces are only listed once
+// b. hits on faces are reported with id Nshapes+face (see gridShape)
+void gridPopulateMesh(grid_t *grid, const mesh_t *mesh){
+
+  free(grid->faceStarts);
+  free(grid->faceContents);
+
+  grid->mesh = mesh;
+
+  const int Nboxes = grid->NI*grid->NJ*grid->NK;
+
+  // count faces overlapping each cell
+  int *counts = (int*) calloc(Nboxes+1, sizeof(int));
+  for(int f=0;f<mesh->Nfaces;++f){
+    const bbox_t bbox = gridFaceBounds(grid, mesh, f);
+    for(int k=bbox.kmin;k<=bbox.kmax;++k)
+      for(int j=bbox.jmin;j<=bbox.jmax;++j)
+	for(int i=bbox.imin;i<=bbox.imax;++i)
+	  ++counts[i + j*grid->NI + k*grid->NI*grid->NJ];
+  }
+
+  // make cumulative count
+  grid->faceStarts = (int*) calloc(Nboxes+1, sizeof(int));
+  const int Nentries = gridScan(Nboxes, counts, grid->faceStarts);
+
+  grid->faceContents = (int*) calloc(Nentries, sizeof(int));
+
+  // use counts as running insertion point of each cell
+  memcpy(counts, grid->faceStarts, (Nboxes+1)*sizeof(int));
+  for(int f=0;f<mesh->Nfaces;++f){
+    const bbox_t bbox = gridFaceBounds(grid, mesh, f);
+    for(int k=bbox.kmin;k<=bbox.kmax;++k)
+      for(int j=bbox.jmin;j<=bbox.jmax;++j)
+	for(int i=bbox.imin;i<=bbox.imax;++i)
+	  grid->faceContents[counts[i + j*grid->NI + k*grid->NI*grid->NJ]++] = f;
+  }
+
+  free(counts);
+}
+
+// shape with the given id, ids from Nshapes on are faces of the grid mesh
+shape_t gridShape(const grid_t &grid, const int Nshapes, const shape_t *shapes, const int id){
+
+  return (id<Nshapes) ? shapes[id] : meshShape(grid.mesh, id-Nshapes);
+}
+
+// list the spheres in the cells of their fattened bounds, returns the number of
+// spheres re-inserted
+// Notes:
+//
+// a. a sphere is inserted with its bounds grown by the distance it travels in
+//    p_gridFattening frames (at most p_gridMaxMargin radii), shape.bbox keeps
+//    the fattened cell range
+// b. the sphere lists are only rebuilt when a sphere has left the fattened cell
+//    range, and only the escaped spheres get new bounds
+// c. the sphere lists are small, the static shapes are indexed once by
+//    gridPopulateStatic
+int gridUpdateSpheres(grid_t *grid, const bodies_t *bodies, shape_t *shapes){
+
+  const int Nbodies = bodies->Nbodies;
+  const int first = (grid->sphereStarts==NULL);
+
+  int Nescaped = 0;
+
+#pragma omp parallel for reduction(+:Nescaped)
+  for(int b=0;b<Nbodies;++b){
+    shape_t &shape = shapes[bodies->shapeIds[b]];
+
+    const bbox_t tight = createBoundingBoxShape(*grid, shape);
+    const bbox_t &fat  = shape.bbox;
+
+    if(first ||
+       tight.imin<fat.imin || tight.imax>fat.imax ||
+       tight.jmin<fat.jmin || tight.jmax>fat.jmax ||
+       tight.kmin<fat.kmin || tight.kmax>fat.kmax){
+
+      const dfloat margin = min(p_gridFattening*p_frameTime*shape.sphere.speed, p_gridMaxMargin*shape.sphere.radius);
+
+      shape_t fattened = shape;
+      fattened.sphere.radius += margin;
+      shape.bbox = createBoundingBoxShape(*grid, fattened);
+
+      ++Nescaped;
+    }
+  }
+
+  if(!Nescaped) return 0;
+
+  const int Nboxes = grid->NI*grid->NJ*grid->NK;
+
+  if(first){
+    grid->sphereStarts   = (int*) calloc(Nboxes+1, sizeof(int));
+    grid->sphereCounters = (int*) calloc(Nboxes+1, sizeof(int));
+  }
+
+  // count spheres overlapping each cell
+  int *counts = grid->sphereCounters;
+  for(int c=0;c<=Nboxes;++c)
+    counts[c] = 0;
+
+  for(int b=0;b<Nbodies;++b){
+    const bbox_t &bbox = shapes[bodies->shapeIds[b]].bbox;
+    for(int k=bbox.kmin;k<=bbox.kmax;++k)
+      for(int j=bbox.jmin;j<=bbox.jmax;++j)
+	for(int i=bbox.imin;i<=bbox.imax;++i)
+	  ++counts[i + j*grid->NI + k*grid->NI*grid->NJ];
+  }
+
+  // make cumulative count
+  const int Nentries = gridScan(Nboxes, counts, grid->sphereStarts);
+
+  free(grid->sphereContents);
+  grid->sphereContents = (int*) calloc(Nentries, sizeof(int));
+
+  // use counts as running insertion point of each cell
+  memcpy(counts, grid->sphereStarts, (Nboxes+1)*sizeof(int));
+  gridAddShapesInCellsKernel(*grid, Nbodies, bodies->shapeIds, shapes, counts, grid->sphereContents);
+
+  return Nescaped;
+}
@@ -0,0 +1,50 @@
+#include "simpleRayTracer.h"
+
+// indexed triangle meshes
+// Notes:
+//
+// a. each vertex is stored once and shared by the faces around it, a face is
+//    three vertex indices (a bunny face costs 12 bytes plus about half a
+//    vertex instead of a whole shape_t)
+// b. the render grid lists face indices, triangles are only assembled from
+//    the vertex buffer when a ray or a distance query needs them
+// c. compiling with -DmeshFloat=float halves the vertex buffer, rays and
+//    distances are still evaluated in dfloat
+// d. faces share one material unless the mesh has a material per face
+//    (meshes from a scene file)
+
+// vertices of one face
+triangle_t meshTriangle(const mesh_t *mesh, const int face){
+
+  triangle_t triangle;
+
+  const int *f = mesh->faces + 3*face;
+  for(int v=0;v<3;++v){
+    const meshVertex_t &vertex = mesh->vertices[f[v]];
+    triangle.vertices[v] = vectorCreate(vertex.x, vertex.y, vertex.z);
+  }
+
+  return triangle;
+}
+
+// one face as a triangle shape (for normals, materials and distances)
+shape_t meshShape(const mesh_t *mesh, const int face){
+
+  shape_t shape;
+  memset(&shape, 0, sizeof(shape_t));
+
+  shape.id = face;
+  shape.type = TRIANGLE;
+  shape.triangle = meshTriangle(mesh, face);
+  shape.material = mesh->faceMaterials ? mesh->faceMaterials[face] : mesh->material;
+
+  return shape;
+}
+
+void meshFree(mesh_t *mesh){
+
+  free(mesh->vertices);
+  free(mesh->faces);
+  free(mesh->faceMaterials);
+  free(mesh);
+}
@@ -0,0 +1,443 @@
+#include <unistd.h>
+#include "simpleRayTracer.h"
+
+// frame output shared by all ranks
+// Notes:
+//
+// a. each rank passes the rows it rendered to the output in order, either in
+//    bands while rendering (communication thread) or all at once at frame end
+// b. with ring set the image buffer of a rank only holds a ring of
+//    outputBufferRows rows, row r of the stripe is in slot r%ringRows (see
+//    outputRow) and is reused once the row has been passed on, so the memory
+//    of a rank does not grow with the image (the root of the gathering modes
+//    still assembles whole frames, and OUTPUT_QOI needs the whole stripe so
+//    it always keeps it)
+// c. OUTPUT_MPIIO: rank 0 writes the PPM header, rows streamed during the frame
+//    are written independently, any rows left at frame end collectively
+// d. OUTPUT_GATHER: rows are sent to rank 0 which assembles and writes the frame
+// e. OUTPUT_Y4M and OUTPUT_RGB: frames are assembled on rank 0 as for
+//    OUTPUT_GATHER and appended to one stream (a file, or stdout for "-" so an
+//    encoder can read frames as they are produced), Y4M frames are converted
+//    to 4:2:0 first
+// f. OUTPUT_QOI: rows stay with their rank until frame end, then each rank
+//    compresses blocks of p_qoiBlockRows rows in parallel (see qoi.c), the
+//    compressed sizes are scanned for the file offsets and every rank writes
+//    its part collectively, rank 0 adds the header and end marker
+// g. when the stream is stdout every rank sends its own stdout to stderr so
+//    messages do not end up in the stream
+// h. with MPI_THREAD_FUNNELED only the master thread may call these functions
+
+#define OUTPUT_TAG_ROWS 101
+#define OUTPUT_TAG_DATA 102
+
+// pixel blocks converted to chroma at a time
+#define OUTPUT_CHUNK 64
+
+// modes where whole frames are assembled on rank 0
+static int outputGathers(const int mode){
+  return mode==OUTPUT_GATHER || mode==OUTPUT_Y4M || mode==OUTPUT_RGB;
+}
+
+output_t *outputSetup(MPI_Comm comm, const int mode, const int width, const int height, const char *streamName,
+		      const int ring){
+
+  output_t *output = (output_t*) calloc(1, sizeof(output_t));
+
+  output->comm   = comm;
+  output->mode   = mode;
+  output->width  = width;
+  output->height = height;
+
+  MPI_Comm_rank(comm, &(output->rank));
+  MPI_Comm_size(comm, &(output->size));
+
+  // a few bands and a row for every rendering thread so threads rarely wait for a slot
+  if(ring && mode!=OUTPUT_QOI)
+    output->ringRows = p_outputBand*p_outputRingBands + omp_get_max_threads();
+
+  // one row of pixels, 3 bytes per pixel
+  MPI_Type_contiguous(3*width, MPI_UNSIGNED_CHAR, &(output->MPI_ROW));
+  MPI_Type_commit(&(output->MPI_ROW));
+
+  if(outputGathers(mode) && output->rank==0)
+    output->frame = (unsigned char*) calloc(3*width*height, sizeof(char));
+
+  if(mode==OUTPUT_Y4M || mode==OUTPUT_RGB){
+    const int toStdout = !strcmp(streamName, "-");
+
+    fflush(stdout);
+
+    if(output->rank==0){
+      output->stream = toStdout ? fdopen(dup(STDOUT_FILENO), "wb") : fopen(streamName, "wb");
+      if(!output->stream){
+	printf("outputSetup: could not open stream %s\n", streamName);
+	MPI_Abort(comm, 1);
+      }
+    }
+
+    if(toStdout)
+      dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    // stream header (full range BT.601 4:2:0 with centred chroma, readers assume
+    // limited range unless told otherwise)
+    if(mode==OUTPUT_Y4M && output->rank==0){
+      output->yuv = (unsigned char*) calloc(width*height + 2*((width+1)/2)*((height+1)/2), sizeof(char));
+      fprintf(output->stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", width, height, p_videoFrameRate);
+    }
+  }
+
+  return output;
+}
+
+// interleaved RGB loads need byte shuffles (SSSE3 or AVX2) to vectorise, on
+// x86 the pixel loops are cloned for these and chosen at run time
+#if defined(__x86_64__) && defined(__GNUC__)
+#define OUTPUT_SIMD_CLONES __attribute__((target_clones("avx2","ssse3","default")))
+#else
+#define OUTPUT_SIMD_CLONES
+#endif
+
+// full range BT.601 chroma in 18 bit fixed point: weighted channel sums of four
+// pixels, then offset and scaled to a byte
+static inline int outputCbWeight(const int r, const int g, const int b){
+  return -11059*r - 21709*g + 32768*b;
+}
+
+static inline int outputCrWeight(const int r, const int g, const int b){
+  return 32768*r - 27439*g - 5329*b;
+}
+
+static inline unsigned char outputChroma(const int weight){
+  return min((weight + (128<<18) + (1<<17))>>18, 255);
+}
+
+// luma of one row
+OUTPUT_SIMD_CLONES
+static void outputLumaRow(const int width, const unsigned char *row, unsigned char *y){
+
+#pragma omp simd
+  for(int i=0;i<width;++i)
+    y[i] = (19595*row[3*i] + 38470*row[3*i+1] + 7471*row[3*i+2] + 32768)>>16;
+}
+
+// chroma of the 2x2 blocks of two rows (the last column is repeated for an odd width)
+// Notes:
+//
+// a. chroma is linear so the weights of the column sums of the two rows are
+//    found per pixel (unit stride in pixels) and then added in pairs
+OUTPUT_SIMD_CLONES
+static void outputChromaRows(const int width, const unsigned char *row0, const unsigned char *row1,
+			     unsigned char *u, unsigned char *v){
+
+  const int Nblocks = width/2;
+
+  for(int i0=0;i0<Nblocks;i0+=OUTPUT_CHUNK){
+    const int N = min(OUTPUT_CHUNK, Nblocks-i0);
+    const unsigned char *p0 = row0 + 6*i0;
+    const unsigned char *p1 = row1 + 6*i0;
+
+    int cb[2*OUTPUT_CHUNK], cr[2*OUTPUT_CHUNK];
+
+#pragma omp simd
+    for(int i=0;i<2*N;++i){
+      const int r = p0[3*i  ] + p1[3*i  ];
+      const int g = p0[3*i+1] + p1[3*i+1];
+      const int b = p0[3*i+2] + p1[3*i+2];
+      cb[i] = outputCbWeight(r, g, b);
+      cr[i] = outputCrWeight(r, g, b);
+    }
+
+#pragma omp simd
+    for(int i=0;i<N;++i){
+      u[i0+i] = outputChroma(cb[2*i] + cb[2*i+1]);
+      v[i0+i] = outputChroma(cr[2*i] + cr[2*i+1]);
+    }
+  }
+
+  if(width%2){
+    const int i = 3*(width-1);
+    const int r = 2*(row0[i  ] + row1[i  ]);
+    const int g = 2*(row0[i+1] + row1[i+1]);
+    const int b = 2*(row0[i+2] + row1[i+2]);
+    u[Nblocks] = outputChroma(outputCbWeight(r, g, b));
+    v[Nblocks] = outputChroma(outputCrWeight(r, g, b));
+  }
+}
+
+// convert an RGB frame to Y, U and V planes, chroma is the average of each 2x2
+// block (the last row is repeated for an odd height)
+// Notes:
+//
+// a. integer fixed point so the pixel loops vectorise with omp simd, rows are
+//    shared between threads
+static void outputRGBToYUV420(const int width, const int height, const unsigned char *rgb, unsigned char *yuv){
+
+  const int cwidth  = (width+1)/2;
+  const int cheight = (height+1)/2;
+
+  unsigned char *Y = yuv;
+  unsigned char *U = Y + width*height;
+  unsigned char *V = U + cwidth*cheight;
+
+#pragma omp parallel for
+  for(int j=0;j<height;++j)
+    outputLumaRow(width, rgb + (size_t)3*width*j, Y + (size_t)width*j);
+
+#pragma omp parallel for
+  for(int j=0;j<cheight;++j)
+    outputChromaRows(width,
+		     rgb + (size_t)3*width*(2*j),
+		     rgb + (size_t)3*width*min(2*j+1, height-1),
+		     U + (size_t)cwidth*j,
+		     V + (size_t)cwidth*j);
+}
+
+// collective: start a new frame, this rank will output rows [rowStart,rowEnd)
+void outputFrameBegin(output_t *output, const char *fileName, const int rowStart, const int rowEnd){
+
+  strcpy(output->fileName, fileName);
+  output->rowStart = rowStart;
+  output->rowEnd   = rowEnd;
+  output->rowsWritten  = 0;
+  output->rowsReceived = 0;
+
+  if(output->mode==OUTPUT_MPIIO){
+    char header[BUFSIZ];
+    output->headerLength = sprintf(header, "P6 %d %d %d\n", output->width, output->height, 255);
+
+    // truncate any older and larger file
+    MPI_File_open(output->comm, output->fileName, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &(output->fh));
+    MPI_File_set_size(output->fh, output->headerLength + (MPI_Offset)3*output->width*output->height);
+
+    // PPM header info is written once
+    if(output->rank==0)
+      MPI_File_write_at(output->fh, 0, header, output->headerLength, MPI_CHAR, MPI_STATUS_IGNORE);
+  }
+}
+
+// rows of this rank's stripe held in the image buffer
+int outputBufferRows(const output_t *output){
+
+  const int Nrows = output->rowEnd - output->rowStart;
+
+  return output->ringRows ? min(output->ringRows, Nrows) : Nrows;
+}
+
+// pixels of row (of this rank's stripe) in the image buffer img
+unsigned char *outputRow(const output_t *output, unsigned char *img, const int row){
+
+  const int slot = output->ringRows ? row%output->ringRows : row;
+
+  return img + (size_t)3*output->width*slot;
+}
+
+// root receives one band of rows from another rank if blocking or if one is waiting
+static int outputReceiveRows(output_t *output, const int blocking){
+
+  MPI_Status status;
+  int flag = 1;
+
+  if(blocking)
+    MPI_Probe(MPI_ANY_SOURCE, OUTPUT_TAG_ROWS, output->comm, &status);
+  else
+    MPI_Iprobe(MPI_ANY_SOURCE, OUTPUT_TAG_ROWS, output->comm, &flag, &status);
+
+  if(!flag) return 0;
+
+  int rows[2]; // first row and number of rows
+  MPI_Recv(rows, 2, MPI_INT, status.MPI_SOURCE, OUTPUT_TAG_ROWS, output->comm, MPI_STATUS_IGNORE);
+  MPI_Recv(output->frame + (size_t)3*output->width*rows[0], rows[1], output->MPI_ROW,
+	   status.MPI_SOURCE, OUTPUT_TAG_DATA, output->comm, MPI_STATUS_IGNORE);
+
+  output->rowsReceived += rows[1];
+
+  return 1;
+}
+
+// consecutive rows from row in the image buffer (up to the end of the ring)
+static int outputContiguousRows(const output_t *output, const int row, const int Nrows){
+  return output->ringRows ? min(Nrows, output->ringRows - row%output->ringRows) : Nrows;
+}
+
+// pass the next Nrows rows of this rank's stripe in the image buffer img to the output
+void outputRows(output_t *output, unsigned char *img, int Nrows){
+
+  // rows that wrap around the end of a ring are passed on in two pieces
+  while(Nrows>0){
+    const int N = outputContiguousRows(output, output->rowsWritten, Nrows);
+    const int row = output->rowStart + output->rowsWritten;
+    const unsigned char *rows = outputRow(output, img, output->rowsWritten);
+
+    if(output->mode==OUTPUT_MPIIO){
+      MPI_Offset offset = output->headerLength + (MPI_Offset)3*output->width*row;
+      MPI_File_write_at(output->fh, offset, rows, N, output->MPI_ROW, MPI_STATUS_IGNORE);
+    }
+
+    if(outputGathers(output->mode)){
+      if(output->rank==0){
+	memcpy(output->frame + (size_t)3*output->width*row, rows, (size_t)3*output->width*N);
+      }
+      else{
+	int header[2] = {row, N};
+	MPI_Send(header, 2, MPI_INT, 0, OUTPUT_TAG_ROWS, output->comm);
+	MPI_Send(rows, N, output->MPI_ROW, 0, OUTPUT_TAG_DATA, output->comm);
+      }
+    }
+
+    // rendering threads may reuse the slots now
+#pragma omp flush
+#pragma omp atomic
+    output->rowsWritten += N;
+
+    Nrows -= N;
+  }
+}
+
+// receive output bands already sent by other ranks without blocking, returns
+// the number of bands received
+int outputProgress(output_t *output){
+
+  int Nbands = 0;
+  if(outputGathers(output->mode) && output->rank==0)
+    while(outputReceiveRows(output, 0))
+      ++Nbands;
+
+  return Nbands;
+}
+
+// collective: compress this rank's stripe img and write the QOI file
+static void outputQOI(output_t *output, const unsigned char *img){
+
+  const int width   = output->width;
+  const int Nrows   = output->rowEnd - output->rowStart;
+  const int Nblocks = (Nrows + p_qoiBlockRows-1)/p_qoiBlockRows;
+
+  // every block is compressed into its own slot of the buffer first
+  const size_t slot = qoiBound((size_t)width*p_qoiBlockRows);
+  if(output->qoiSize < slot*Nblocks){
+    output->qoiSize = slot*Nblocks;
+    output->qoi = (unsigned char*) realloc(output->qoi, output->qoiSize);
+  }
+
+  size_t *blockBytes = (size_t*) calloc(Nblocks+1, sizeof(size_t));
+
+#pragma omp parallel for schedule(dynamic)
+  for(int block=0;block<Nblocks;++block){
+    const int row0 = block*p_qoiBlockRows;
+    const int row1 = min(row0+p_qoiBlockRows, Nrows);
+    const unsigned char *pixels = img + (size_t)3*width*row0;
+
+    // the pixel before the first block belongs to the rank above
+    blockBytes[block] = qoiEncode(pixels, (size_t)width*(row1-row0), block ? pixels-3 : NULL,
+				  output->qoi + slot*block);
+  }
+
+  // close the gaps between blocks
+  size_t bytes = 0;
+  for(int block=0;block<Nblocks;++block){
+    memmove(output->qoi + bytes, output->qoi + slot*block, blockBytes[block]);
+    bytes += blockBytes[block];
+  }
+
+  free(blockBytes);
+
+  // file offsets follow from the compressed sizes of the ranks above
+  long long int myBytes = bytes, offset = 0, total = 0;
+  MPI_Exscan(&myBytes, &offset, 1, MPI_LONG_LONG_INT, MPI_SUM, output->comm);
+  MPI_Allreduce(&myBytes, &total, 1, MPI_LONG_LONG_INT, MPI_SUM, output->comm);
+  if(output->rank==0) offset = 0; // MPI_Exscan leaves rank 0 undefined
+
+  MPI_File fh;
+  MPI_File_open(output->comm, output->fileName, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+
+  // truncate any older and larger file
+  MPI_File_set_size(fh, QOI_HEADER_SIZE + total + QOI_END_SIZE);
+
+  if(output->rank==0){
+    unsigned char header[QOI_HEADER_SIZE], end[QOI_END_SIZE];
+    qoiHeader(width, output->height, header);
+    qoiEnd(end);
+    MPI_File_write_at(fh, 0, header, QOI_HEADER_SIZE, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, QOI_HEADER_SIZE + total, end, QOI_END_SIZE, MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+  }
+
+  // MPI counts are int, large stripes are written in pieces
+  const MPI_Offset piece = 1<<30;
+  const MPI_Offset Npieces = (total + piece-1)/piece;
+  for(MPI_Offset n=0;n<Npieces;++n){
+    const MPI_Offset start = min(n*piece, (MPI_Offset)bytes);
+    const int count = (int) (min((n+1)*piece, (MPI_Offset)bytes) - start);
+    MPI_File_write_at_all(fh, QOI_HEADER_SIZE + offset + start, output->qoi + start, count,
+			  MPI_UNSIGNED_CHAR, MPI_STATUS_IGNORE);
+  }
+
+  MPI_File_close(&fh);
+}
+
+// collective: output the rows of img not yet passed on and finish the frame
+void outputFrameEnd(output_t *output, unsigned char *img){
+
+  const int Nrows = output->rowEnd - output->rowStart;
+  const int Nleft = Nrows - output->rowsWritten;
+
+  if(output->mode==OUTPUT_MPIIO){
+    // all ranks take part in both writes even if they have no rows left (the
+    // rows left may wrap around the end of a ring)
+    for(int piece=0;piece<2;++piece){
+      const int N = outputContiguousRows(output, output->rowsWritten, Nrows-output->rowsWritten);
+      const int row = output->rowStart + output->rowsWritten;
+      MPI_Offset offset = output->headerLength + (MPI_Offset)3*output->width*row;
+      MPI_File_write_at_all(output->fh, offset, outputRow(output, img, output->rowsWritten),
+			    N, output->MPI_ROW, MPI_STATUS_IGNORE);
+      output->rowsWritten += N;
+    }
+
+    MPI_File_close(&(output->fh));
+  }
+
+  if(output->mode==OUTPUT_QOI){
+    outputQOI(output, img);
+    output->rowsWritten = Nrows;
+  }
+
+  if(outputGathers(output->mode)){
+    outputRows(output, img, Nleft);
+
+    if(output->rank==0){
+      while(output->rowsReceived < output->height - Nrows)
+	outputReceiveRows(output, 1);
+
+      const int width  = output->width;
+      const int height = output->height;
+
+      if(output->mode==OUTPUT_GATHER)
+	saveppm(output->fileName, output->frame, width, height);
+
+      if(output->mode==OUTPUT_RGB)
+	fwrite(output->frame, 3, (size_t)width*height, output->stream);
+
+      if(output->mode==OUTPUT_Y4M){
+	outputRGBToYUV420(width, height, output->frame, output->yuv);
+	fputs("FRAME\n", output->stream);
+	fwrite(output->yuv, 1, (size_t)width*height + 2*((width+1)/2)*((height+1)/2), output->stream);
+      }
+
+      // hand the frame to the reader now
+      if(output->stream)
+	fflush(output->stream);
+    }
+  }
+}
+
+void outputFree(output_t *output){
+
+  if(output->stream)
+    fclose(output->stream);
+
+  MPI_Type_free(&(output->MPI_ROW));
+
+  free(output->frame);
+  free(output->yuv);
+  free(output->qoi);
+  free(output);
+}
@@ -0,0 +1,137 @@
+#include "simpleRayTracer.h"
+
+// lossless QOI ("Quite OK Image") encoding of RGB pixels
+// Notes:
+//
+// a. the file is a 14 byte header, a stream of ops and an 8 byte end marker,
+//    every op is one byte (a run of the previous pixel, a slot of a 64 entry
+//    table of recent pixels, or a small difference to the previous pixel)
+//    except for larger differences (2 bytes) and full pixels (4 bytes)
+// b. a decoder runs through the ops in order so the previous pixel and the
+//    table depend on all pixels before, qoiEncode compresses a block of pixels
+//    without knowing the pixels before it and the result is still a valid
+//    part of the stream:
+//    - table slots count as unknown until the block itself sets them (a
+//      decoder sets a slot for every pixel, so a slot the block set holds the
+//      same pixel for the decoder)
+//    - the previous pixel is passed in when known (e.g. the pixel before a
+//      block of rows in the same stripe), otherwise the first pixel is written
+//      in full
+//    - runs are ended at the block end
+// c. blocks can then be compressed in parallel and concatenated, a block loses
+//    only the table hits of its first few pixels
+// d. alpha is always 255, as is the alpha of the pixel a decoder starts from
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+#define QOI_MAX_RUN 62
+
+static inline int qoiHash(const int r, const int g, const int b){
+  return (3*r + 5*g + 7*b + 11*255)%64;
+}
+
+static inline void qoiPut32(unsigned char *c, const unsigned int v){
+  c[0] = v>>24; c[1] = v>>16; c[2] = v>>8; c[3] = v;
+}
+
+// header of a width x height RGB image (sRGB), returns its size
+int qoiHeader(const int width, const int height, unsigned char *header){
+
+  memcpy(header, "qoif", 4);
+  qoiPut32(header+4, width);
+  qoiPut32(header+8, height);
+  header[12] = 3; // channels
+  header[13] = 0; // sRGB with linear alpha
+
+  return QOI_HEADER_SIZE;
+}
+
+// largest encoded size of Npixels pixels (all written in full)
+size_t qoiBound(const size_t Npixels){
+  return 4*Npixels;
+}
+
+// encode Npixels RGB pixels following the pixel prev (NULL if not known) into
+// out (at least qoiBound(Npixels) bytes), returns the encoded size
+size_t qoiEncode(const unsigned char *rgb, const size_t Npixels, const unsigned char *prev, unsigned char *out){
+
+  unsigned char table[64][3];
+  uint64_t known = 0; // slots set by this block
+
+  int havePrev = (prev!=NULL);
+  int pr = havePrev ? prev[0] : 0;
+  int pg = havePrev ? prev[1] : 0;
+  int pb = havePrev ? prev[2] : 0;
+
+  size_t n = 0;
+  int run = 0;
+
+  for(size_t p=0;p<Npixels;++p){
+    const int r = rgb[3*p], g = rgb[3*p+1], b = rgb[3*p+2];
+
+    if(havePrev && r==pr && g==pg && b==pb){
+      if(++run==QOI_MAX_RUN){
+	out[n++] = QOI_OP_RUN | (run-1);
+	run = 0;
+      }
+      continue;
+    }
+
+    if(run){
+      out[n++] = QOI_OP_RUN | (run-1);
+      run = 0;
+    }
+
+    const int h = qoiHash(r, g, b);
+
+    if(((known>>h)&1) && table[h][0]==r && table[h][1]==g && table[h][2]==b){
+      out[n++] = QOI_OP_INDEX | h;
+    }
+    else{
+      known |= (uint64_t)1<<h;
+      table[h][0] = r; table[h][1] = g; table[h][2] = b;
+
+      // differences wrap around as in the decoder
+      const int dr = (signed char)(r-pr);
+      const int dg = (signed char)(g-pg);
+      const int db = (signed char)(b-pb);
+      const int drg = dr-dg;
+      const int dbg = db-dg;
+
+      if(havePrev && dr>=-2 && dr<=1 && dg>=-2 && dg<=1 && db>=-2 && db<=1){
+	out[n++] = QOI_OP_DIFF | (dr+2)<<4 | (dg+2)<<2 | (db+2);
+      }
+      else if(havePrev && dg>=-32 && dg<=31 && drg>=-8 && drg<=7 && dbg>=-8 && dbg<=7){
+	out[n++] = QOI_OP_LUMA | (dg+32);
+	out[n++] = (drg+8)<<4 | (dbg+8);
+      }
+      else{
+	out[n++] = QOI_OP_RGB;
+	out[n++] = r;
+	out[n++] = g;
+	out[n++] = b;
+      }
+    }
+
+    pr = r; pg = g; pb = b;
+    havePrev = 1;
+  }
+
+  if(run)
+    out[n++] = QOI_OP_RUN | (run-1);
+
+  return n;
+}
+
+// end marker, returns its size
+int qoiEnd(unsigned char *end){
+
+  memset(end, 0, QOI_END_SIZE);
+  end[QOI_END_SIZE-1] = 1;
+
+  return QOI_END_SIZE;
+}
@@ -1,106 +1,623 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "simpleRayTracer.h"
 
-void readPlyModel(const char *fileName, int *Ntriangles, triangle_t **triangles){
+// PLY triangle mesh loader
+// Notes:
+//
+// a. the file is memory mapped and the header is parsed once, the element and
+//    property declarations give the layout of the records that follow
+// b. ascii, binary_little_endian and binary_big_endian data are decoded
+//    straight from the mapping with no stdio calls
+// c. ascii records are split at line boundaries (one record per line as the
+//    format requires) and parsed on all threads into preallocated arrays
+// d. only the x, y, z vertex properties and the face vertex index list are
+//    used, all other elements and properties are skipped
+// e. the result is an indexed mesh, vertices are stored once and faces are
+//    triples of vertex indices
+// f. the vertex element must come before the face element, polygons with
+//    more than three vertices are split into triangle fans
 
-  FILE *fp = fopen(fileName, "r");
+static const int plyTypeSizes[9] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
 
-  char buf[BUFSIZ];
+static void plyFail(const char *fileName, const char *message){
 
-  int Nvertices;
-  
-  //check to see if we have end_header
-  //we will later assume all properties come before end_header
-  while (fgets(buf, BUFSIZ, fp) && !strstr(buf,"end_header"));
+  printf("ply read %s failed: %s\n", fileName, message);
+  printf("aborting execution as input file is not sane\n");
+  exit(1);
+}
+
+// property type from its name (0 if unknown)
+static int plyType(const char *name){
+
+  if(!strcmp(name, "char")   || !strcmp(name, "int8"))    return PLY_INT8;
+  if(!strcmp(name, "uchar")  || !strcmp(name, "uint8"))   return PLY_UINT8;
+  if(!strcmp(name, "short")  || !strcmp(name, "int16"))   return PLY_INT16;
+  if(!strcmp(name, "ushort") || !strcmp(name, "uint16"))  return PLY_UINT16;
+  if(!strcmp(name, "int")    || !strcmp(name, "int32"))   return PLY_INT32;
+  if(!strcmp(name, "uint")   || !strcmp(name, "uint32"))  return PLY_UINT32;
+  if(!strcmp(name, "float")  || !strcmp(name, "float32")) return PLY_FLOAT32;
+  if(!strcmp(name, "double") || !strcmp(name, "float64")) return PLY_FLOAT64;
+
+  return 0;
+}
+
+// parse the header lines up to end_header
+static void plyParseHeader(const char *fileName, const char *data, const size_t size, plyHeader_t *header){
+
+  memset(header, 0, sizeof(plyHeader_t));
+
+  if(size<4 || strncmp(data, "ply", 3))
+    plyFail(fileName, "ply magic number not found");
+
+  size_t offset = 0;
+  char line[BUFSIZ];
+
+  while(offset<size){
+
+    // copy one line
+    size_t length = 0;
+    while(offset+length<size && data[offset+length]!='\n') ++length;
+    const size_t copied = min(length, (size_t)BUFSIZ-1);
+    memcpy(line, data+offset, copied);
+    line[copied] = '\0';
+    offset += length+1;
+
+    char word[3][64];
+    const int Nwords = sscanf(line, "%63s %63s %63s", word[0], word[1], word[2]);
+    if(Nwords<1) continue;
+
+    if(!strcmp(word[0], "end_header")){
+      header->headerLength = min(offset, size);
+      break;
+    }
+
+    if(!strcmp(word[0], "format") && Nwords>=2){
+      if(!strcmp(word[1], "ascii"))                header->format = PLY_ASCII;
+      if(!strcmp(word[1], "binary_little_endian")) header->format = PLY_BINARY_LE;
+      if(!strcmp(word[1], "binary_big_endian"))    header->format = PLY_BINARY_BE;
+    }
+
+    if(!strcmp(word[0], "element")){
+      if(header->Nelements==p_plyMaxElements)
+	plyFail(fileName, "too many elements");
+
+      plyElement_t &element = header->elements[header->Nelements++];
+      if(sscanf(line, "element %63s %ld", element.name, &element.count)!=2)
+	plyFail(fileName, "bad element declaration");
+    }
 
-  if (!strstr(buf,"end_header")) {
-    printf("ply read %s failed: end_header tag not found\n",fileName);
-    printf("aborting execution as input file is not sane\n");
-    exit(1);
+    if(!strcmp(word[0], "property")){
+      if(header->Nelements==0)
+	plyFail(fileName, "property declared before any element");
+
+      plyElement_t &element = header->elements[header->Nelements-1];
+      if(element.Nproperties==p_plyMaxProperties)
+	plyFail(fileName, "too many properties");
+
+      plyProperty_t &property = element.properties[element.Nproperties++];
+
+      char countType[64], itemType[64];
+      if(!strcmp(word[1], "list")){
+	if(sscanf(line, "property list %63s %63s %63s", countType, itemType, property.name)!=3)
+	  plyFail(fileName, "bad list property declaration");
+	property.countType = plyType(countType);
+	property.type      = plyType(itemType);
+	if(!property.countType || property.countType>=PLY_FLOAT32)
+	  plyFail(fileName, "list length must be an integer type");
+      }
+      else{
+	if(Nwords<3)
+	  plyFail(fileName, "bad property declaration");
+	property.countType = 0;
+	property.type      = plyType(word[1]);
+	strcpy(property.name, word[2]);
+      }
+
+      if(!property.type)
+	plyFail(fileName, "unknown property type");
+    }
   }
 
-  //look for vertex number
-  rewind(fp);
+  if(!header->headerLength)
+    plyFail(fileName, "end_header tag not found");
 
-  while (fgets(buf, BUFSIZ, fp) && !strstr(buf,"element vertex") && !strstr(buf,"end_header"));
+  if(!header->format)
+    plyFail(fileName, "unknown format");
+}
 
-  if (strstr(buf,"end_header")) {
-    printf("ply read %s failed: element vertex tag not found\n",fileName);
-    printf("aborting execution as input file is not sane\n");
-    exit(1);
-  } 
+// value of a binary property of the given type (byte swapped if swap)
+static double plyBinaryValue(const unsigned char *p, const int type, const int swap){
 
-  sscanf(buf, "element vertex %d", &Nvertices);
+  unsigned char b[8];
+  const int size = plyTypeSizes[type];
+  for(int i=0;i<size;++i)
+    b[i] = swap ? p[size-1-i] : p[i];
 
-  //look for element face number
-  rewind(fp);
+  switch(type){
+  case PLY_INT8:    { int8_t   v; memcpy(&v, b, 1); return v; }
+  case PLY_UINT8:   { uint8_t  v; memcpy(&v, b, 1); return v; }
+  case PLY_INT16:   { int16_t  v; memcpy(&v, b, 2); return v; }
+  case PLY_UINT16:  { uint16_t v; memcpy(&v, b, 2); return v; }
+  case PLY_INT32:   { int32_t  v; memcpy(&v, b, 4); return v; }
+  case PLY_UINT32:  { uint32_t v; memcpy(&v, b, 4); return v; }
+  case PLY_FLOAT32: { float    v; memcpy(&v, b, 4); return v; }
+  case PLY_FLOAT64: { double   v; memcpy(&v, b, 8); return v; }
+  }
 
-  while (fgets(buf, BUFSIZ, fp) && !strstr(buf,"element face") && !strstr(buf,"end_header"));
-  
-  if (strstr(buf,"end_header")) {
-    printf("ply read %s failed: element face tag not found\n",fileName);
-    printf("aborting execution as input file is not sane\n");
-    exit(1);
-  } 
-  
-  sscanf(buf, "element face %d", Ntriangles);
+  return 0;
+}
 
-  //rewind and scan to end of property tags
-  rewind(fp);
-  while(fgets(buf,BUFSIZ,fp) && !strstr(buf,"end_header"));
+// read the next binary value at cursor and advance past it
+static double plyNext(const char **cursor, const char *end,
+		      const int type, const int swap, const char *fileName){
 
-  dfloat *x = (dfloat*) calloc(Nvertices, sizeof(dfloat));
-  dfloat *y = (dfloat*) calloc(Nvertices, sizeof(dfloat));
-  dfloat *z = (dfloat*) calloc(Nvertices, sizeof(dfloat));
+  if(*cursor + plyTypeSizes[type] > end)
+    plyFail(fileName, "unexpected end of file");
 
-  dfloat xmin = 1e9, xmax = -1e9, ymin = 1e9, ymax = -1e9, zmin = 1e9, zmax = -1e9;
-  
-  printf("buf=%s\n", buf);
-  for(int v=0;v<Nvertices;++v){
-    fscanf(fp, dfloatString dfloatString dfloatString, x+v, y+v, z+v);
-    fgets(buf,BUFSIZ,fp);
-    xmin = min(xmin, x[v]);
-    xmax = max(xmax, x[v]);
-    ymin = min(ymin, y[v]);
-    ymax = max(ymax, y[v]);
-    zmin = min(zmin, z[v]);
-    zmax = max(zmax, z[v]);
+  const double v = plyBinaryValue((const unsigned char*) *cursor, type, swap);
+  *cursor += plyTypeSizes[type];
+  return v;
+}
+
+// powers of ten that are exact in double precision
+static const double plyPowersOfTen[23] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// parse an ascii number at cursor and advance past it, returns 0 if there is
+// no number
+// Notes:
+//
+// a. a decimal with at most 2^53 as its digit string and a power of ten up to
+//    22 is one exact integer scaled by one exact power of ten, so a single
+//    multiply or divide gives the correctly rounded value (same as strtod)
+// b. anything else (long mantissas, large exponents, inf, nan) uses strtod
+// c. numbers never continue on the next line (strtod would skip the newline),
+//    so a record with too few values is malformed
+static int plyParseNumber(const char **cursor, double *value){
+
+  const char *p = *cursor;
+  while(*p==' ' || *p=='\t' || *p=='\r') ++p;
+
+  if(*p=='\n' || *p=='\0')
+    return 0;
+
+  const char *start = p;
+  const int negative = (*p=='-');
+  if(*p=='-' || *p=='+') ++p;
+
+  const uint64_t maxExact = ((uint64_t)1)<<53;
+  uint64_t mantissa = 0;
+  int exponent = 0, Ndigits = 0, exact = 1;
+
+  for(;*p>='0' && *p<='9';++p, ++Ndigits){
+    mantissa = 10*mantissa + (*p-'0');
+    if(mantissa>maxExact){ exact = 0; break; }
+  }
+  if(exact && *p=='.'){
+    for(++p;*p>='0' && *p<='9';++p, ++Ndigits){
+      mantissa = 10*mantissa + (*p-'0');
+      --exponent;
+      if(mantissa>maxExact){ exact = 0; break; }
+    }
+  }
+  if(exact && (*p=='e' || *p=='E')){
+    ++p;
+    const int negativeExponent = (*p=='-');
+    if(*p=='-' || *p=='+') ++p;
+    int e = 0;
+    if(*p<'0' || *p>'9') exact = 0;
+    for(;*p>='0' && *p<='9' && e<10000;++p)
+      e = 10*e + (*p-'0');
+    exponent += negativeExponent ? -e : e;
+  }
+
+  if(exact && Ndigits>0 && exponent>=-22 && exponent<=22 && (*p<'0' || *p>'9')){
+    double v = (double) mantissa;
+    v = (exponent<0) ? v/plyPowersOfTen[-exponent] : v*plyPowersOfTen[exponent];
+    *value = negative ? -v : v;
+    *cursor = p;
+    return 1;
+  }
+
+  char *next;
+  *value = strtod(start, &next);
+  if(next==start)
+    return 0;
+  *cursor = next;
+  return 1;
+}
+
+// find the start of the first Nlines+1 lines after begin, lines past the end
+// of the data start at end
+static void plyIndexLines(const char *begin, const char *end, const long Nlines, const char **starts){
+
+  const size_t length = end-begin;
+  const int Nchunks = omp_get_max_threads();
+  long *Nnewlines = (long*) calloc(Nchunks+1, sizeof(long));
+
+  // count line ends in equal byte ranges
+#pragma omp parallel for
+  for(int c=0;c<Nchunks;++c){
+    const char *p  = begin + (length*c)/Nchunks;
+    const char *hi = begin + (length*(c+1))/Nchunks;
+    long count = 0;
+    while(p<hi && (p = (const char*) memchr(p, '\n', hi-p))){
+      ++count;
+      ++p;
+    }
+    Nnewlines[c+1] = count;
+  }
+
+  for(int c=0;c<Nchunks;++c)
+    Nnewlines[c+1] += Nnewlines[c];
+
+  for(long l=min(Nnewlines[Nchunks]+1, Nlines+1);l<=Nlines;++l)
+    starts[l] = end;
+  starts[0] = begin;
+
+  // line l+1 starts after the l'th line end
+#pragma omp parallel for
+  for(int c=0;c<Nchunks;++c){
+    const char *p  = begin + (length*c)/Nchunks;
+    const char *hi = begin + (length*(c+1))/Nchunks;
+    long line = Nnewlines[c];
+    while(line<Nlines && p<hi && (p = (const char*) memchr(p, '\n', hi-p))){
+      starts[++line] = ++p;
+    }
+  }
+
+  free(Nnewlines);
+}
+
+// parse one ascii record, x/y/z property values go to xyz and if fan is given
+// the index list is written to it as a fan of triangles (three indices each);
+// returns the number of triangles in the fan or -1 if the record is malformed
+static int plyAsciiRecord(const char *p, const plyElement_t &element,
+			  const int px, const int py, const int pz, const int pIndices,
+			  dfloat *xyz, const int Nvertices, int *fan){
+
+  int Ntriangles = 0;
+  double v;
+
+  for(int n=0;n<element.Nproperties;++n){
+    const plyProperty_t &property = element.properties[n];
+
+    if(!plyParseNumber(&p, &v)) return -1;
+
+    if(!property.countType){
+      if(n==px) xyz[0] = v;
+      if(n==py) xyz[1] = v;
+      if(n==pz) xyz[2] = v;
+      continue;
+    }
+
+    const int Nitems = (int) v;
+
+    if(n==pIndices){
+      Ntriangles = max(Nitems-2, 0);
+      // counting pass
+      if(!fan) return Ntriangles;
+    }
+
+    int v0 = 0, vprev = 0;
+    for(int i=0;i<Nitems;++i){
+      if(!plyParseNumber(&p, &v)) return -1;
+      if(n!=pIndices) continue;
+
+      const int vi = (int) v;
+      if(vi<0 || vi>=Nvertices) return -1;
+
+      // fan of triangles (v0, v[i-1], v[i])
+      if(i>=2){
+	fan[3*(i-2)+0] = v0;
+	fan[3*(i-2)+1] = vprev;
+	fan[3*(i-2)+2] = vi;
+      }
+      if(i==0) v0 = vi;
+      vprev = vi;
+    }
+  }
+
+  return Ntriangles;
+}
+
+// parse the records of one ascii element in parallel, one record per line
+// Notes:
+//
+// a. vertex records are written straight into x, y, z
+// b. faces are parsed twice, the first pass counts the triangles of each face
+//    so the second pass can write every fan at its final place
+// c. other elements are skipped without being parsed
+static void plyAsciiElement(const char *fileName, const plyElement_t &element, const char **lines,
+			    const int px, const int py, const int pz, const int pIndices,
+			    const int Nvertices, dfloat *x, dfloat *y, dfloat *z,
+			    int *Nfaces, int **faces){
+
+  const long Nrecords = element.count;
+  int bad = 0;
+
+  if(pIndices<0 && px>=0){
+#pragma omp parallel for reduction(|:bad)
+    for(long r=0;r<Nrecords;++r){
+      dfloat xyz[3];
+      bad |= (plyAsciiRecord(lines[r], element, px, py, pz, -1, xyz, 0, NULL)<0);
+      x[r] = xyz[0];
+      y[r] = xyz[1];
+      z[r] = xyz[2];
+    }
+  }
+
+  if(pIndices>=0){
+    long *offsets = (long*) calloc(Nrecords+1, sizeof(long));
+
+#pragma omp parallel for reduction(|:bad)
+    for(long r=0;r<Nrecords;++r){
+      dfloat xyz[3];
+      const int Nfan = plyAsciiRecord(lines[r], element, -1, -1, -1, pIndices, xyz, Nvertices, NULL);
+      bad |= (Nfan<0);
+      offsets[r+1] = max(Nfan, 0);
+    }
+
+    if(bad)
+      plyFail(fileName, "missing or malformed value");
+
+    for(long r=0;r<Nrecords;++r)
+      offsets[r+1] += offsets[r];
+
+    *Nfaces = offsets[Nrecords];
+    *faces  = (int*) calloc(3*max(*Nfaces,1), sizeof(int));
+
+#pragma omp parallel for reduction(|:bad)
+    for(long r=0;r<Nrecords;++r){
+      dfloat xyz[3];
+      bad |= (plyAsciiRecord(lines[r], element, -1, -1, -1, pIndices, xyz,
+			     Nvertices, faces[0]+3*offsets[r])<0);
+    }
+
+    free(offsets);
+  }
+
+  if(bad)
+    plyFail(fileName, "missing, malformed or out of range value");
+}
+
+void readPlyModel(const char *fileName, mesh_t *mesh){
+
+  int fd = open(fileName, O_RDONLY);
+  if(fd<0)
+    plyFail(fileName, "could not open file");
+
+  struct stat st;
+  fstat(fd, &st);
+  const size_t size = st.st_size;
+
+  char *map = (char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map==MAP_FAILED)
+    plyFail(fileName, "could not map file");
+
+  madvise(map, size, MADV_SEQUENTIAL);
+
+  plyHeader_t header;
+  plyParseHeader(fileName, map, size, &header);
+
+  // strtod needs a terminator after the last ascii number, the mapping is zero
+  // padded to the end of its last page unless the file fills it exactly
+  const char *data = map;
+  char *copy = NULL;
+  if(header.format==PLY_ASCII && size%sysconf(_SC_PAGESIZE)==0){
+    copy = (char*) malloc(size+1);
+    memcpy(copy, map, size);
+    copy[size] = '\0';
+    data = copy;
+  }
+
+  const int one = 1;
+  const int hostLittleEndian = *((const char*) &one);
+  const int swap = (header.format==PLY_BINARY_LE && !hostLittleEndian) ||
+                   (header.format==PLY_BINARY_BE &&  hostLittleEndian);
+
+  const char *cursor = data + header.headerLength;
+  const char *end    = data + size;
+
+  // start of every ascii record
+  const char **lines = NULL;
+  if(header.format==PLY_ASCII){
+    long Nrecords = 0;
+    for(int e=0;e<header.Nelements;++e)
+      Nrecords += header.elements[e].count;
+
+    lines = (const char**) calloc(Nrecords+1, sizeof(const char*));
+    plyIndexLines(cursor, end, Nrecords, lines);
+  }
+  long firstRecord = 0;
+
+  int Nvertices = -1;
+  dfloat *x = NULL, *y = NULL, *z = NULL;
+
+  int Nfaces = 0;
+  int *faces = NULL;
+  int haveFaces = 0;
+
+  for(int e=0;e<header.Nelements;++e){
+    const plyElement_t &element = header.elements[e];
+    const int isVertex = !strcmp(element.name, "vertex");
+    const int isFace   = !strcmp(element.name, "face");
+
+    // properties that are used
+    int px = -1, py = -1, pz = -1, pIndices = -1;
+    for(int p=0;p<element.Nproperties;++p){
+      const plyProperty_t &property = element.properties[p];
+      if(isVertex && !property.countType){
+	if(!strcmp(property.name, "x")) px = p;
+	if(!strcmp(property.name, "y")) py = p;
+	if(!strcmp(property.name, "z")) pz = p;
+      }
+      if(isFace && property.countType &&
+	 (!strcmp(property.name, "vertex_indices") || !strcmp(property.name, "vertex_index")))
+	pIndices = p;
+    }
+
+    if(isVertex){
+      if(px<0 || py<0 || pz<0)
+	plyFail(fileName, "vertex element needs x, y and z properties");
+
+      Nvertices = element.count;
+      x = (dfloat*) calloc(Nvertices, sizeof(dfloat));
+      y = (dfloat*) calloc(Nvertices, sizeof(dfloat));
+      z = (dfloat*) calloc(Nvertices, sizeof(dfloat));
+    }
+
+    if(isFace){
+      if(pIndices<0)
+	plyFail(fileName, "face element needs a vertex_indices list");
+      if(Nvertices<0)
+	plyFail(fileName, "vertex element must come before face element");
+
+      // one triangle per face unless there are polygons (ascii faces are counted first)
+      if(header.format!=PLY_ASCII)
+	faces = (int*) calloc(3*max(element.count,1), sizeof(int));
+      haveFaces = 1;
+    }
+
+    if(header.format==PLY_ASCII){
+      plyAsciiElement(fileName, element, lines+firstRecord, px, py, pz, pIndices,
+		      Nvertices, x, y, z, &Nfaces, &faces);
+      firstRecord += element.count;
+    }
+
+    long capacity = max(element.count, 1);
+
+    for(long r=0;r<element.count && header.format!=PLY_ASCII;++r){
+      for(int p=0;p<element.Nproperties;++p){
+	const plyProperty_t &property = element.properties[p];
+
+	if(!property.countType){
+	  const double v = plyNext(&cursor, end, property.type, swap, fileName);
+	  if(p==px) x[r] = v;
+	  if(p==py) y[r] = v;
+	  if(p==pz) z[r] = v;
+	  continue;
+	}
+
+	const int Nitems = (int) plyNext(&cursor, end, property.countType, swap, fileName);
+
+	if(p!=pIndices){
+	  for(int i=0;i<Nitems;++i)
+	    plyNext(&cursor, end, property.type, swap, fileName);
+	  continue;
+	}
+
+	// fan of triangles (v0, v[i-1], v[i])
+	int v0 = 0, vprev = 0;
+	for(int i=0;i<Nitems;++i){
+	  const int v = (int) plyNext(&cursor, end, property.type, swap, fileName);
+	  if(v<0 || v>=Nvertices)
+	    plyFail(fileName, "vertex index out of range");
+
+	  if(i>=2){
+	    if(Nfaces==capacity){
+	      capacity *= 2;
+	      faces = (int*) realloc(faces, 3*capacity*sizeof(int));
+	    }
+	    int *face = faces + 3*(Nfaces++);
+	    face[0] = v0;
+	    face[1] = vprev;
+	    face[2] = v;
+	  }
+	  if(i==0) v0 = v;
+	  vprev = v;
+	}
+      }
+    }
+
+    // place the model in the world box once all vertices are read
+    if(isVertex){
+      dfloat xmin = 1e9, xmax = -1e9, ymin = 1e9, ymax = -1e9, zmin = 1e9, zmax = -1e9;
+
+      for(int v=0;v<Nvertices;++v){
+	xmin = min(xmin, x[v]);
+	xmax = max(xmax, x[v]);
+	ymin = min(ymin, y[v]);
+	ymax = max(ymax, y[v]);
+	zmin = min(zmin, z[v]);
+	zmax = max(zmax, z[v]);
+      }
+
+      printf("min/max = %g,%g - %g,%g - %g,%g\n",
+	     xmin,xmax, ymin,ymax, zmin,zmax);
+
+      for(int v=0;v<Nvertices;++v){
+	dfloat xv = (x[v]-xmin)/(xmax-xmin);
+	dfloat zv = (y[v]-ymin)/(ymax-ymin);
+	dfloat yv = (z[v]-zmin)/(zmax-zmin);
+	x[v] = BOXSIZE/4    + 0.5*BOXSIZE*(1-xv);
+	z[v] = 3.*BOXSIZE/4.- 0.5*HEIGHT*yv;
+	y[v] = HEIGHT      - 0.5*BOXSIZE*zv;
+      }
+    }
   }
-  printf("buf=%s\n", buf);
 
-  printf("min/max = %g,%g - %g,%g - %g,%g\n",
-	 xmin,xmax, ymin,ymax, zmin,zmax);
+  if(Nvertices<0)
+    plyFail(fileName, "element vertex tag not found");
+  if(!haveFaces)
+    plyFail(fileName, "element face tag not found");
+
+  printf("Read %d triangles and %d vertices from %s\n", Nfaces, Nvertices, fileName);
 
+  mesh->Nvertices = Nvertices;
+  mesh->vertices  = (meshVertex_t*) calloc(Nvertices, sizeof(meshVertex_t));
   for(int v=0;v<Nvertices;++v){
-    dfloat xv = (x[v]-xmin)/(xmax-xmin);
-    dfloat zv = (y[v]-ymin)/(ymax-ymin);
-    dfloat yv = (z[v]-zmin)/(zmax-zmin);
-    x[v] = BOXSIZE/4    + 0.5*BOXSIZE*(1-xv);
-    z[v] = 3.*BOXSIZE/4.- 0.5*HEIGHT*yv;
-    y[v] = HEIGHT      - 0.5*BOXSIZE*zv;
-  }
-  
-  *triangles = (triangle_t*) calloc(*Ntriangles, sizeof(triangle_t));
-  for(int e=0;e<*Ntriangles;++e){
-    int v1, v2, v3;
-    fscanf(fp, "%*d %d %d %d", &v1, &v2, &v3);
-    //    printf("V=%d,%d,%d\n", v1, v2, v3);
-    triangles[0][e].vertices[0] = vectorCreate(x[v1], y[v1], z[v1]);
-    triangles[0][e].vertices[1] = vectorCreate(x[v2], y[v2], z[v2]);
-    triangles[0][e].vertices[2] = vectorCreate(x[v3], y[v3], z[v3]);
-
-#if 0
-    printf("t %d: (%g,%g,%g), (%g,%g,%g), (%g,%g,%g)\n",
-	   e,
-	   triangles[0][e].vertices[0].x, triangles[0][e].vertices[0].y, triangles[0][e].vertices[0].z,
-	   triangles[0][e].vertices[1].x, triangles[0][e].vertices[1].y, triangles[0][e].vertices[1].z,
-	   triangles[0][e].vertices[2].x, triangles[0][e].vertices[2].y, triangles[0][e].vertices[2].z);
-#endif
-  }
-
-  printf("Read %d triangles and %d vertices from %s\n", *Ntriangles, Nvertices, fileName); 
-  
+    mesh->vertices[v].x = x[v];
+    mesh->vertices[v].y = y[v];
+    mesh->vertices[v].z = z[v];
+  }
+
+  mesh->Nfaces = Nfaces;
+  mesh->faces  = faces;
+
+  munmap(map, size);
+  free(lines);
+  free(copy);
   free(x); free(y); free(z);
 }
+
+// only rank 0 touches the file system, the other ranks receive the
+// parsed vertices and faces as packed binary broadcasts
+void bcastPlyModel(MPI_Comm comm, const char *fileName, mesh_t *mesh){
+
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  if(rank==0)
+    readPlyModel(fileName, mesh);
+
+  MPI_Bcast(&(mesh->Nvertices), 1, MPI_INT, 0, comm);
+  MPI_Bcast(&(mesh->Nfaces),    1, MPI_INT, 0, comm);
+
+  if(rank!=0){
+    mesh->vertices = (meshVertex_t*) calloc(mesh->Nvertices, sizeof(meshVertex_t));
+    mesh->faces    = (int*) calloc(3*mesh->Nfaces, sizeof(int));
+  }
+
+  // send whole vertices and faces so the counts stay in range for large meshes
+  MPI_Datatype MPI_VERTEX, MPI_FACE;
+  MPI_Type_contiguous(sizeof(meshVertex_t), MPI_BYTE, &MPI_VERTEX);
+  MPI_Type_contiguous(3, MPI_INT, &MPI_FACE);
+  MPI_Type_commit(&MPI_VERTEX);
+  MPI_Type_commit(&MPI_FACE);
+
+  MPI_Bcast(mesh->vertices, mesh->Nvertices, MPI_VERTEX, 0, comm);
+  MPI_Bcast(mesh->faces,    mesh->Nfaces,    MPI_FACE,   0, comm);
+
+  MPI_Type_free(&MPI_VERTEX);
+  MPI_Type_free(&MPI_FACE);
+}
@@ -1,20 +1,26 @@
+#include <unistd.h>
 #include "simpleRayTracer.h"
 
-void renderKernel(const int NI,
-		  const int NJ,
-		  scene_t scene,
-		  const sensor_t sensor,
-		  const dfloat costheta,
-		  const dfloat sintheta,
-		  const dfloat *randomNumbers,
-		  unsigned char *img){
+// sleep while waiting on the output, the delay doubles (up to
+// p_outputMaxBackoff) each time the wait continues
+static void renderBackoff(int *delay){
+
+  usleep(*delay);
+  *delay = min(2*(*delay), p_outputMaxBackoff);
+}
 
-  int rank;
-  int size;
+// render the pixels of sensor row J into row (3*NI bytes)
+static void renderRow(const int NI,
+		      const int NJ,
+		      const int J,
+		      const scene_t &scene,
+		      const sensor_t &sensor,
+		      const dfloat costheta,
+		      const dfloat sintheta,
+		      const dfloat *randomNumbers,
+		      capture_t *capture,
+		      unsigned char *row){
 
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &size);
-  
   const colour_t bg = sensor.bg;
 
   // unpack contents of scene
@@ -27,101 +33,216 @@ void renderKernel(const int NI,
   const int Nmaterials = scene.Nmaterials;
   const int Nshapes    = scene.Nshapes;
 
-  // (I,J) loop over pixels in image
-
-  int start = (size-rank-1)*NJ/size;
-  int end = (size-rank)*NJ/size;
+  // I loop over pixels in row
+  for(int I=0;I<NI;++I){
+    ray_t r;
     
-  for(int J=start;J<end;++J){
-    for(int I=0;I<NI;++I){
-      ray_t r;
-      
-      dfloat coef = 1.0;
-      int level = 0;
-      
-      // 2.5 location of sensor pixel
-      colour_t c;
-      
-      dfloat x0 = sensor.eyeX.x;
-      dfloat y0 = sensor.eyeX.y;
-      dfloat z0 = sensor.eyeX.z;
-      
-      // multiple rays emanating from sensor, passing through lens and focusing at the focal plane
-      // 1. compute intersection of ray passing through lens center to focal plane
-      
-      // (sensorX + alpha*(lensC -sensorX)).sensorN = focalPlaneOffset
-      // alpha = (focalOffset-s.sensorN)/( (lensC-s).sensorN) [ . dot product ]
+    dfloat coef = 1.0;
+    int level = 0;
+    
+    // 2.5 location of sensor pixel
+    colour_t c;
+    
+    dfloat x0 = sensor.eyeX.x;
+    dfloat y0 = sensor.eyeX.y;
+    dfloat z0 = sensor.eyeX.z;
+    
+    // multiple rays emanating from sensor, passing through lens and focusing at the focal plane
+    // 1. compute intersection of ray passing through lens center to focal plane
+    
+    // (sensorX + alpha*(lensC -sensorX)).sensorN = focalPlaneOffset
+    // alpha = (focalOffset-s.sensorN)/( (lensC-s).sensorN) [ . dot product ]
+    
+    dfloat cx = BOXSIZE/2., cy =  HEIGHT, cz = BOXSIZE/2;
+    
+    vector_t sensorN = vectorCrossProduct(sensor.Idir, sensor.Jdir);
+    vector_t sensorX = sensorLocation(NI, NJ, I, J, sensor);
+    dfloat   focalPlaneOffset = sensor.focalPlaneOffset;
+    vector_t centralRayDir = vectorSub(sensor.lensC, sensorX);
+    dfloat alpha = (focalPlaneOffset - vectorDot(sensorX, sensorN))/vectorDot(centralRayDir, sensorN);
+    
+    // 2. target
+    vector_t targetX = vectorAdd(sensorX, vectorScale(alpha, centralRayDir));
+    
+    x0 = sensorX.x;
+    y0 = sensorX.y;
+    z0 = sensorX.z;
+    
+    // 3.  loop over vertical offsets on lens (thin lens)
+    c.red = 0; c.green = 0; c.blue = 0;
+    
+    for(int samp=0;samp<p_Nsamples;++samp){
+
+      // aperture width
+      int sampId = (I+J*NI + samp*25*25)%NRANDOM;
+      dfloat offI = p_apertureRadius;
+      dfloat offJ = p_apertureRadius; 
       
-      dfloat cx = BOXSIZE/2., cy =  HEIGHT, cz = BOXSIZE/2;
+      // choose random starting point on lens (assumes lens and sensor arre parallel)
+      if(samp>0) { // primary ray
+	x0 = sensor.lensC.x + offI*sensor.Idir.x + offJ*sensor.Jdir.x;
+	y0 = sensor.lensC.y + offI*sensor.Idir.y + offJ*sensor.Jdir.y;
+	z0 = sensor.lensC.z + offI*sensor.Idir.z + offJ*sensor.Jdir.z;
+      }
       
-      vector_t sensorN = vectorCrossProduct(sensor.Idir, sensor.Jdir);
-      vector_t sensorX = sensorLocation(NI, NJ, I, J, sensor);
-      dfloat   focalPlaneOffset = sensor.focalPlaneOffset;
-      vector_t centralRayDir = vectorSub(sensor.lensC, sensorX);
-      dfloat alpha = (focalPlaneOffset - vectorDot(sensorX, sensorN))/vectorDot(centralRayDir, sensorN);
+      dfloat dx0 = targetX.x - x0;
+      dfloat dy0 = targetX.y - y0;
+      dfloat dz0 = targetX.z - z0;
       
-      // 2. target
-      vector_t targetX = vectorAdd(sensorX, vectorScale(alpha, centralRayDir));
+      dfloat L0 = sqrt(dx0*dx0+dy0*dy0+dz0*dz0);
+      dx0 = dx0/L0;
+      dy0 = dy0/L0;
+      dz0 = dz0/L0;
       
-      x0 = sensorX.x;
-      y0 = sensorX.y;
-      z0 = sensorX.z;
+      r.start.x = costheta*(x0-cx) - sintheta*(z0-cz) + cx;
+      r.start.y = y0;
+      r.start.z = sintheta*(x0-cx) + costheta*(z0-cz) + cz;
       
-      // 3.  loop over vertical offsets on lens (thin lens)
-      c.red = 0; c.green = 0; c.blue = 0;
+      r.dir.x = costheta*dx0 - sintheta*dz0;
+      r.dir.y = dy0;
+      r.dir.z = sintheta*dx0 + costheta*dz0;
+
+      // capture the rays traced for a fixed sample of the lens samples
+      capture_t *sampleCapture =
+	(capture && ((size_t)(I+J*NI)*p_Nsamples+samp)%capture->every==0) ? capture : NULL;
+
+      // trace ray through scene (possibly with multipathing, reflection, refraction)
+      colour_t newc =
+	gridTrace(grid[0], Nshapes, shapes, Nlights, lights, Nmaterials, materials, r, level, coef, bg, sampleCapture);
+
+      // add colors to final intensity for IJ pixel
+      dfloat sc = (samp==0) ? p_primaryWeight: 1.f;
+      c.red   += sc*newc.red;
+      c.green += sc*newc.green;
+      c.blue  += sc*newc.blue;
       
-      for(int samp=0;samp<p_Nsamples;++samp){
+    }
+    
+    // primary weighted average
+    c.red   /= (p_primaryWeight+p_Nsamples-1);
+    c.green /= (p_primaryWeight+p_Nsamples-1);
+    c.blue  /= (p_primaryWeight+p_Nsamples-1);
+    
+    // store pixel rgb intensities
+    row[I*3 + 0] = (unsigned char)min(  c.red*255.0f, 255.0f);
+    row[I*3 + 1] = (unsigned char)min(c.green*255.0f, 255.0f);
+    row[I*3 + 2] = (unsigned char)min( c.blue*255.0f, 255.0f);
+  }
+}
 
-	// aperture width
-	int sampId = (I+J*NI + samp*25*25)%NRANDOM;
-	dfloat offI = p_apertureRadius;
-	dfloat offJ = p_apertureRadius; 
-	
-	// choose random starting point on lens (assumes lens and sensor arre parallel)
-	if(samp>0) { // primary ray
-	  x0 = sensor.lensC.x + offI*sensor.Idir.x + offJ*sensor.Jdir.x;
-	  y0 = sensor.lensC.y + offI*sensor.Idir.y + offJ*sensor.Jdir.y;
-	  z0 = sensor.lensC.z + offI*sensor.Idir.z + offJ*sensor.Jdir.z;
+// render image rows [rowStart,rowEnd) into img, which holds only those rows
+// (or a ring of them, see outputRow), and record the time taken by each of
+// these rows in rowCost (indexed by image row)
+// Notes:
+//
+// a. with more than one OpenMP thread, thread 0 does not render: it is reserved to
+//    pass finished bands of rows to the output and to receive output bands
+//    from other ranks, so the rendering threads never block on MPI calls
+// b. rendering threads take rows one at a time from a shared counter
+// c. rows not passed to the output here are left for outputFrameEnd
+// d. with a ring buffer a row waits until the row last held in its slot has
+//    been passed on (by the communication thread, or by the only thread, in
+//    which case the root also receives bands from other ranks between rows)
+// e. with a capture (NULL for none) the rays of one in capture->every lens
+//    samples are recorded
+// f. threads that find nothing to do sleep with a growing delay instead of
+//    spinning, the delay resets once a band is passed on or received
+void renderKernel(const int NI,
+		  const int NJ,
+		  const int rowStart,
+		  const int rowEnd,
+		  scene_t scene,
+		  const sensor_t sensor,
+		  const dfloat costheta,
+		  const dfloat sintheta,
+		  const dfloat *randomNumbers,
+		  unsigned char *img,
+		  dfloat *rowCost,
+		  output_t *output,
+		  capture_t *capture){
+
+  const int Nrows = rowEnd-rowStart;
+
+  int nextRow = 0;
+  char *rowDone = (char*) calloc(Nrows, sizeof(char));
+
+#pragma omp parallel
+  {
+    const int thread   = omp_get_thread_num();
+    const int Nthreads = omp_get_num_threads();
+
+    if(thread==0 && Nthreads>1){
+      // communication thread: stream finished bands of rows in order
+      int delay = 1;
+      while(output->rowsWritten<Nrows){
+	int Nready = output->rowsWritten;
+	int done = 1;
+	while(Nready<Nrows && done){
+#pragma omp atomic read
+	  done = rowDone[Nready];
+	  if(done) ++Nready;
 	}
+#pragma omp flush
 	
-	dfloat dx0 = targetX.x - x0;
-	dfloat dy0 = targetX.y - y0;
-	dfloat dz0 = targetX.z - z0;
-	
-	dfloat L0 = sqrt(dx0*dx0+dy0*dy0+dz0*dz0);
-	dx0 = dx0/L0;
-	dy0 = dy0/L0;
-	dz0 = dz0/L0;
-	
-	r.start.x = costheta*(x0-cx) - sintheta*(z0-cz) + cx;
-	r.start.y = y0;
-	r.start.z = sintheta*(x0-cx) + costheta*(z0-cz) + cz;
-	
-	r.dir.x = costheta*dx0 - sintheta*dz0;
-	r.dir.y = dy0;
-	r.dir.z = sintheta*dx0 + costheta*dz0;
-
-	// trace ray through scene (possibly with multipathing, reflection, refraction)
-	colour_t newc =
-	  gridTrace(grid[0], Nshapes, shapes, Nlights, lights, Nmaterials, materials, r, level, coef, bg);
-
-	// add colors to final intensity for IJ pixel
-	dfloat sc = (samp==0) ? p_primaryWeight: 1.f;
-	c.red   += sc*newc.red;
-	c.green += sc*newc.green;
-	c.blue  += sc*newc.blue;
-	
+	Nready -= output->rowsWritten;
+	if(Nready>=p_outputBand || (Nready>0 && output->rowsWritten+Nready==Nrows)){
+	  outputRows(output, img, Nready);
+	  delay = 1;
+	}
+	else if(outputProgress(output))
+	  delay = 1;
+	else
+	  renderBackoff(&delay);
+      }
+    }
+    else{
+      while(1){
+	int row;
+#pragma omp atomic capture
+	row = nextRow++;
+
+	if(row>=Nrows) break;
+
+	if(output->ringRows){
+	  int delay = 1;
+	  while(1){
+	    int written;
+#pragma omp atomic read
+	    written = output->rowsWritten;
+
+	    if(row<written+output->ringRows) break;
+
+	    // all rows before this one are done if there is no communication thread
+	    if(Nthreads==1)
+	      outputRows(output, img, row-written);
+	    else
+	      renderBackoff(&delay);
+	  }
+#pragma omp flush
+	}
+
+	// image row is reversed because of lensing
+	const int J = NJ-1-(rowStart+row);
+
+	// only the master thread may call MPI (MPI_THREAD_FUNNELED)
+	double rowTic = omp_get_wtime();
+
+	renderRow(NI, NJ, J, scene, sensor, costheta, sintheta, randomNumbers, capture,
+		  outputRow(output, img, row));
+
+	rowCost[rowStart+row] = omp_get_wtime()-rowTic;
+
+#pragma omp flush
+#pragma omp atomic write
+	rowDone[row] = 1;
+
+	// with no communication thread the root receives the bands other ranks
+	// send from their rings between its own rows (their sends block until then)
+	if(Nthreads==1)
+	  outputProgress(output);
       }
-      
-      // primary weighted average
-      c.red   /= (p_primaryWeight+p_Nsamples-1);
-      c.green /= (p_primaryWeight+p_Nsamples-1);
-      c.blue  /= (p_primaryWeight+p_Nsamples-1);
-      
-      // store pixel rgb intensities (reverse vertical because of lensing)
-      img[(I + (NJ-1-J)*NI)*3 + 0] = (unsigned char)min(  c.red*255.0f, 255.0f);
-      img[(I + (NJ-1-J)*NI)*3 + 1] = (unsigned char)min(c.green*255.0f, 255.0f);
-      img[(I + (NJ-1-J)*NI)*3 + 2] = (unsigned char)min( c.blue*255.0f, 255.0f);
     }
   }
+
+  free(rowDone);
 }
@@ -0,0 +1,186 @@
+#include "simpleRayTracer.h"
+
+// replay of captured rays through the intersection searches
+//
+// to run (with the scene options of the run that captured the rays):
+//  mpiexec -n 4 ./simpleRayTracer -capture rays.bin -end 1 [scene options]
+//  mpiexec -n 4 ./replay -rays rays.bin [-engine grid,brute] [-repeat R] [scene options]
+//
+// Notes:
+//
+// a. the scene is built (or mapped with -cache) as in simpleRayTracer and the
+//    spheres moved to where they were in the captured frame
+// b. every rank replays an equal share of the rays, OpenMP threads take them
+//    in chunks, the time is the largest over the ranks
+// c. the checksum is a sum of a hash of the shape hit and its distance over
+//    all rays, so it does not depend on the order of the rays, and mismatched
+//    counts the rays whose result differs from the captured one
+// d. add other engines to replayEngines, "brute" tests every shape and mesh
+//    face and is the reference for the grid search
+
+// nearest hit among all shapes and mesh faces
+static bool replayBruteForce(const ray_t r, const int Nshapes, const shape_t *shapes, const grid_t grid,
+			     dfloat *t, int *currentShape){
+
+  *currentShape = -1;
+
+  for(int s=0;s<Nshapes;++s)
+    if(intersectRayShape(r, shapes[s], t))
+      *currentShape = s;
+
+  const int Nfaces = grid.mesh ? grid.mesh->Nfaces : 0;
+  for(int f=0;f<Nfaces;++f)
+    if(intersectRayTriangle(r, meshTriangle(grid.mesh, f), t))
+      *currentShape = Nshapes+f;
+
+  return *currentShape!=-1;
+}
+
+static const char *replayEngineNames[] = {"grid", "brute"};
+static const intersectionSearch_t replayEngines[] = {gridRayIntersectionSearch, replayBruteForce};
+static const int replayNengines = 2;
+
+// hash of the result of one search (distance zero for a miss)
+static uint64_t replayHash(const int shape, const dfloat t){
+
+  uint64_t bits = 0;
+  memcpy(&bits, &t, min(sizeof(dfloat), sizeof(uint64_t)));
+
+  uint64_t h = ((uint64_t)(uint32_t)shape)*0x9E3779B97F4A7C15ULL ^ bits;
+  h ^= h>>31; h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h>>27; h *= 0x94D049BB133111EBULL;
+  h ^= h>>31;
+
+  return h;
+}
+
+int main(int argc, char *argv[]){
+
+  // only the master thread of each rank makes MPI calls
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
+
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  sceneOptions_t options = sceneParseOptions(argc, argv);
+
+  const char *raysName = NULL;
+  const char *engineList = "grid";
+  int Nrepeats = 1;
+  for(int n=1;n<argc;++n){
+    if(!strcmp(argv[n], "-rays")   && n+1<argc)  raysName   = argv[n+1];
+    if(!strcmp(argv[n], "-engine") && n+1<argc)  engineList = argv[n+1];
+    if(!strcmp(argv[n], "-repeat") && n+1<argc)  Nrepeats   = max(atoi(argv[n+1]), 1);
+  }
+
+  if(!raysName){
+    if(rank==0)
+      printf("usage: replay -rays file [-engine grid,brute] [-repeat R] [scene options]\n");
+    MPI_Finalize();
+    return 1;
+  }
+
+  // same set up as simpleRayTracer
+  sdf_t   *sdf   = NULL;
+  scene_t *scene = sceneCacheSetup(MPI_COMM_WORLD, &options, &sdf);
+  shape_t *shapes = scene->shapes;
+  grid_t  *grid = scene->grid;
+
+  bodies_t *bodies = bodiesSetup(scene->Nshapes, shapes);
+
+  // spheres where they were in the captured frame
+  int frame;
+  int64_t Nrays;
+  rayRecord_t *rays = captureLoad(MPI_COMM_WORLD, raysName, scene->hash, bodies, &frame, &Nrays);
+
+  bodiesToShapes(bodies, shapes);
+  gridUpdateSpheres(grid, bodies, shapes);
+
+  // rays of each kind
+  long long int kindCounts[4] = {0,0,0,0};
+  for(int64_t n=0;n<Nrays;++n)
+    ++kindCounts[rays[n].kind&3];
+  MPI_Allreduce(MPI_IN_PLACE, kindCounts, 4, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  const long long int NraysTotal = kindCounts[0]+kindCounts[1]+kindCounts[2]+kindCounts[3];
+
+  if(rank==0){
+    printf("%s: %lld rays of frame %d (%lld primary, %lld shadow, %lld reflected, %lld refracted)\n",
+	   raysName, NraysTotal, frame, kindCounts[CAPTURE_PRIMARY], kindCounts[CAPTURE_SHADOW],
+	   kindCounts[CAPTURE_REFLECTED], kindCounts[CAPTURE_REFRACTED]);
+    printf("%8s %9s %10s %12s %18s %11s\n",
+	   "engine", "repeats", "time(s)", "Mrays/s", "checksum", "mismatched");
+  }
+
+  // engines in the order listed
+  char *engines = strdup(engineList);
+  for(char *name=strtok(engines, ",");name;name=strtok(NULL, ",")){
+
+    int e = 0;
+    while(e<replayNengines && strcmp(name, replayEngineNames[e])) ++e;
+    if(e==replayNengines){
+      if(rank==0)
+	printf("%8s unknown engine\n", name);
+      continue;
+    }
+
+    const intersectionSearch_t search = replayEngines[e];
+    const int Nshapes = scene->Nshapes;
+
+    unsigned long long int checksum = 0;
+    long long int Nmismatched = 0;
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double tic = MPI_Wtime();
+
+    for(int repeat=0;repeat<Nrepeats;++repeat){
+      unsigned long long int sum = 0;
+      long long int mismatched = 0;
+
+#pragma omp parallel for schedule(dynamic, 1024) reduction(+:sum, mismatched)
+      for(int64_t n=0;n<Nrays;++n){
+	const rayRecord_t &record = rays[n];
+
+	ray_t r;
+	r.start = record.start;
+	r.dir   = record.dir;
+	r.level = record.level;
+	r.coef  = 1;
+
+	dfloat t = 20000;
+	int shape = -1;
+	search(r, Nshapes, shapes, *grid, &t, &shape);
+	if(shape==-1)
+	  t = 0;
+
+	sum += replayHash(shape, t);
+	if(shape!=record.shape || t!=record.t)
+	  ++mismatched;
+      }
+
+      checksum = sum;
+      Nmismatched = mismatched;
+    }
+
+    double elapsed = MPI_Wtime()-tic;
+    MPI_Allreduce(MPI_IN_PLACE, &elapsed, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &checksum, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &Nmismatched, 1, MPI_LONG_LONG_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    if(rank==0)
+      printf("%8s %9d %10.3f %12.3f %18llx %11lld\n",
+	     name, Nrepeats, elapsed, 1e-6*NraysTotal*Nrepeats/max(elapsed, 1e-9), checksum, Nmismatched);
+  }
+
+  free(engines);
+  free(rays);
+  sdfFree(sdf);
+  bodiesFree(bodies);
+  sceneFree(scene);
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "simpleRayTracer.h"
+
+// binary cache of the built scene, its static grid lists and distance field
+// Notes:
+//
+// a. the file is a sceneCacheHeader_t followed by the scene arrays, each
+//    aligned to p_cacheAlignment bytes, so a mapping of the file is used as is
+// b. the header hash covers the scene options, the contents of the bunny file
+//    (or of the scene file and the mesh files it names), the build parameters
+//    and the struct sizes, any change rebuilds the cache
+// c. the mapping is private and writable: pages that change (the spheres) are
+//    copied on write, the rest stay shared with the page cache
+// d. every rank maps the file, if any rank cannot use it all ranks build the
+//    scene and rank 0 writes a new cache (to a temporary file that is renamed
+//    so a reader never sees a partial cache)
+
+// FNV-1a
+static uint64_t sceneCacheHashBytes(uint64_t hash, const void *data, const size_t bytes){
+
+  const unsigned char *c = (const unsigned char*) data;
+  for(size_t n=0;n<bytes;++n){
+    hash ^= c[n];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+// add the contents of a file (nothing if it cannot be read)
+static uint64_t sceneCacheHashFile(uint64_t hash, const char *fileName){
+
+  int fd = open(fileName, O_RDONLY);
+  if(fd<0) return hash;
+
+  struct stat st;
+  fstat(fd, &st);
+  if(st.st_size>0){
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map!=MAP_FAILED){
+      hash = sceneCacheHashBytes(hash, map, st.st_size);
+      munmap(map, st.st_size);
+    }
+  }
+  close(fd);
+
+  return hash;
+}
+
+// add a scene file and the mesh files named in it (the name after "file")
+static uint64_t sceneCacheHashSceneFile(uint64_t hash, const char *fileName){
+
+  hash = sceneCacheHashFile(hash, fileName);
+
+  FILE *fp = fopen(fileName, "r");
+  if(!fp) return hash;
+
+  char token[BUFSIZ], previous[BUFSIZ] = "";
+  while(fscanf(fp, "%1023s", token)==1){
+    if(!strcmp(previous, "file"))
+      hash = sceneCacheHashFile(hash, token);
+    strcpy(previous, token);
+  }
+  fclose(fp);
+
+  return hash;
+}
+
+// hash of everything the built scene depends on
+static uint64_t sceneCacheHashInputs(const sceneOptions_t *options){
+
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  // byte order and struct layouts
+  const uint64_t layouts[] = {0x0102030405060708ULL, p_cacheVersion,
+			      sizeof(dfloat), sizeof(meshFloat), sizeof(shape_t), sizeof(grid_t),
+			      sizeof(mesh_t), sizeof(sdf_t), sizeof(sceneCacheHeader_t)};
+  hash = sceneCacheHashBytes(hash, layouts, sizeof(layouts));
+
+  // build parameters and scene options
+  const dfloat parameters[] = {SCALE, BOXSIZE, HEIGHT, options->radius, options->L};
+  hash = sceneCacheHashBytes(hash, parameters, sizeof(parameters));
+
+  const int counts[] = {options->Nspheres, options->Nbunnies, options->Ncones, options->Ncylinders,
+			options->layout, options->seed};
+  hash = sceneCacheHashBytes(hash, counts, sizeof(counts));
+
+  // bunny mesh, or the scene description and its meshes
+  if(options->sceneFile)
+    hash = sceneCacheHashSceneFile(hash, options->sceneFile);
+  else
+    hash = sceneCacheHashFile(hash, p_bunnyFile);
+
+  return hash;
+}
+
+// pointers to the arrays of a scene in cache order, with their sizes in bytes
+// if bytes is not NULL (the arrays must then be populated)
+static int sceneCacheArrays(scene_t *scene, sdf_t *sdf, void **arrays[], size_t *bytes){
+
+  grid_t *grid = scene->grid;
+  mesh_t *mesh = scene->mesh;
+
+  const size_t Ncells = grid->NI*grid->NJ*grid->NK;
+  const size_t Nnodes = sdf->NI*sdf->NJ*sdf->NK;
+
+  int Narrays = 0;
+
+#define sceneCacheArray(array, count)					\
+  {									\
+    arrays[Narrays] = (void**) &(array);				\
+    if(bytes) bytes[Narrays] = (count)*sizeof(*(array));		\
+    ++Narrays;								\
+  }
+
+  sceneCacheArray(scene->shapes,      scene->Nshapes);
+  sceneCacheArray(scene->materials,   scene->Nmaterials);
+  sceneCacheArray(scene->lights,      scene->Nlights);
+  sceneCacheArray(mesh->vertices,     mesh->Nvertices);
+  sceneCacheArray(mesh->faces,        3*mesh->Nfaces);
+  sceneCacheArray(mesh->faceMaterials, mesh->faceMaterials ? mesh->Nfaces : 0);
+  sceneCacheArray(grid->bboxes,       Ncells);
+  sceneCacheArray(grid->boxStarts,    Ncells+1);
+  sceneCacheArray(grid->boxContents,  bytes ? grid->boxStarts[Ncells] : 0);
+  sceneCacheArray(grid->faceStarts,   Ncells+1);
+  sceneCacheArray(grid->faceContents, bytes ? grid->faceStarts[Ncells] : 0);
+  sceneCacheArray(sdf->dist,          Nnodes);
+
+#undef sceneCacheArray
+
+  return Narrays;
+}
+
+// write the built scene to fileName
+static void sceneCacheSave(const char *fileName, const uint64_t hash, scene_t *scene, sdf_t *sdf){
+
+  sceneCacheHeader_t header;
+  memset(&header, 0, sizeof(sceneCacheHeader_t));
+
+  memcpy(header.magic, "SRTCACHE", 8);
+  header.version = p_cacheVersion;
+  header.hash    = hash;
+  header.scene   = *scene;
+  header.grid    = *(scene->grid);
+  header.mesh    = *(scene->mesh);
+  header.sdf     = *sdf;
+
+  void **arrays[p_cacheMaxArrays];
+  header.Narrays = sceneCacheArrays(scene, sdf, arrays, header.bytes);
+
+  size_t offset = sizeof(sceneCacheHeader_t);
+  for(int n=0;n<header.Narrays;++n){
+    offset = p_cacheAlignment*((offset+p_cacheAlignment-1)/p_cacheAlignment);
+    header.offsets[n] = offset;
+    offset += header.bytes[n];
+  }
+  header.size = offset;
+
+  char tmpName[BUFSIZ];
+  snprintf(tmpName, BUFSIZ, "%s.%d", fileName, (int) getpid());
+
+  FILE *fp = fopen(tmpName, "wb");
+  if(!fp){
+    printf("sceneCacheSave: could not open %s, scene is not cached\n", tmpName);
+    return;
+  }
+
+  int ok = (fwrite(&header, sizeof(sceneCacheHeader_t), 1, fp)==1);
+
+  const char zeros[p_cacheAlignment] = {0};
+  for(int n=0;n<header.Narrays;++n){
+    ok = ok && !fseek(fp, header.offsets[n], SEEK_SET);
+    if(header.bytes[n])
+      ok = ok && (fwrite(*(arrays[n]), header.bytes[n], 1, fp)==1);
+  }
+
+  // pad to the full size in case the last array is empty
+  ok = ok && !fseek(fp, header.size-1, SEEK_SET) && (fwrite(zeros, 1, 1, fp)==1);
+  ok = !fclose(fp) && ok;
+
+  if(!ok || rename(tmpName, fileName)){
+    printf("sceneCacheSave: could not write %s, scene is not cached\n", fileName);
+    remove(tmpName);
+    return;
+  }
+
+  printf("cached scene in %s (%zu bytes)\n", fileName, header.size);
+}
+
+// map a cache with the given hash, returns NULL if there is no usable cache
+static scene_t *sceneCacheLoad(const char *fileName, const uint64_t hash, sdf_t **sdf){
+
+  int fd = open(fileName, O_RDONLY);
+  if(fd<0) return NULL;
+
+  struct stat st;
+  fstat(fd, &st);
+  const size_t size = st.st_size;
+
+  sceneCacheHeader_t header;
+  if(size<sizeof(sceneCacheHeader_t) ||
+     pread(fd, &header, sizeof(sceneCacheHeader_t), 0)!=(ssize_t)sizeof(sceneCacheHeader_t) ||
+     memcmp(header.magic, "SRTCACHE", 8) ||
+     header.version!=p_cacheVersion ||
+     header.hash!=hash ||
+     header.size!=size ||
+     header.Narrays<0 || header.Narrays>p_cacheMaxArrays){
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(map==MAP_FAILED) return NULL;
+
+  scene_t *scene = (scene_t*) calloc(1, sizeof(scene_t));
+  grid_t  *grid  = (grid_t*)  calloc(1, sizeof(grid_t));
+  mesh_t  *mesh  = (mesh_t*)  calloc(1, sizeof(mesh_t));
+  *sdf           = (sdf_t*)   calloc(1, sizeof(sdf_t));
+
+  // scalars from the header, arrays point into the mapping
+  *scene = header.scene;
+  *grid  = header.grid;
+  *mesh  = header.mesh;
+  **sdf  = header.sdf;
+
+  scene->grid = grid;
+  scene->mesh = mesh;
+  scene->cache = map;
+  scene->cacheSize = size;
+
+  grid->sphereStarts = grid->sphereContents = grid->sphereCounters = NULL;
+  grid->boxOffsets = NULL;
+  grid->mesh = mesh;
+
+  (*sdf)->cached = 1;
+
+  void **arrays[p_cacheMaxArrays];
+  const int Narrays = sceneCacheArrays(scene, *sdf, arrays, NULL);
+
+  // empty arrays stay NULL
+  int ok = (Narrays==header.Narrays);
+  for(int n=0;n<Narrays && ok;++n){
+    ok = (header.offsets[n]+header.bytes[n]<=size);
+    *(arrays[n]) = header.bytes[n] ? (char*) map + header.offsets[n] : NULL;
+  }
+
+  if(!ok){
+    munmap(map, size);
+    free(scene); free(grid); free(mesh); free(*sdf);
+    *sdf = NULL;
+    return NULL;
+  }
+
+  return scene;
+}
+
+// build the scene, its static grid lists and distance field, or map them from
+// options->cacheFile if it holds a scene built from the same inputs (the hash
+// of the inputs is kept in the scene to tag checkpoints and ray captures)
+scene_t *sceneCacheSetup(MPI_Comm comm, const sceneOptions_t *options, sdf_t **sdf){
+
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  const char *fileName = options->cacheFile;
+
+  // only rank 0 reads the input files
+  uint64_t hash = (rank==0) ? sceneCacheHashInputs(options) : 0;
+  MPI_Bcast(&hash, 1, MPI_UINT64_T, 0, comm);
+
+  scene_t *scene = fileName ? sceneCacheLoad(fileName, hash, sdf) : NULL;
+
+  // every rank must take the same path (building the scene is collective)
+  int loaded = (scene!=NULL);
+  MPI_Allreduce(MPI_IN_PLACE, &loaded, 1, MPI_INT, MPI_MIN, comm);
+
+  if(loaded){
+    if(rank==0)
+      printf("loaded scene from cache %s\n", fileName);
+    scene->hash = hash;
+    return scene;
+  }
+
+  if(scene){
+    sdfFree(*sdf);
+    sceneFree(scene);
+  }
+
+  scene = sceneSetup(options);
+
+  // static shapes are sorted into the render grid once, spheres are added every frame
+  gridPopulateStatic(scene->grid, scene->Nshapes, scene->shapes, scene->mesh);
+
+  // physics only needs the distance to the static shapes (computed once)
+  *sdf = sdfSetup(scene->grid, scene->Nshapes, scene->shapes);
+
+  scene->hash = hash;
+
+  if(fileName && rank==0)
+    sceneCacheSave(fileName, hash, scene, *sdf);
+
+  return scene;
+}
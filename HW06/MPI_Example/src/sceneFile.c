@@ -0,0 +1,517 @@
+#include "simpleRayTracer.h"
+
+// scene description files (-scene file)
+// Notes:
+//
+// a. one item per line, a keyword followed by name value pairs, # starts a
+//    comment and vectors and colours are three numbers:
+//      material  glass  diffuse 0.2 0.5 0.9  refract 0.9  eta 2
+//      sphere    center 100 200 300  radius 20  material glass
+//    scenes/example.scene lists every keyword and its properties
+// b. materials are named and must be defined before they are used, the first
+//    one is material 0 (rectangles are checkered between their own material
+//    and material 0)
+// c. spheres are the dynamic bodies, all other shapes are static
+// d. mesh files are read once however many instances use them, every instance
+//    gets its own transformed copy of the vertices in the scene mesh (vertices
+//    start where readPlyModel puts them in the world box), scale, rotate and
+//    translate apply in the order given; single triangles join the same mesh
+// e. rank 0 reads the file and broadcasts its text, every rank parses it so
+//    the meshes are read (and broadcast) in the same order on all ranks
+// f. the world is [0,L] x [0,HEIGHT] x [0,L], the render grid covers it and a
+//    margin, both default to the generated scene (L=BOXSIZE, margin 100, 151^3 cells)
+
+static void sceneFileFail(const sceneFileLine_t *line, const char *message, const char *token){
+
+  printf("scene file %s line %d: %s %s\n", line->fileName, line->line, message, token ? token : "");
+  printf("aborting execution as input file is not sane\n");
+  exit(1);
+}
+
+// next token of the line, fails if there is none
+static const char *sceneFileToken(sceneFileLine_t *line, const char *what){
+
+  if(line->next>=line->Ntokens)
+    sceneFileFail(line, "missing", what);
+
+  return line->tokens[line->next++];
+}
+
+static dfloat sceneFileNumber(sceneFileLine_t *line, const char *what){
+
+  const char *token = sceneFileToken(line, what);
+
+  char *end;
+  dfloat value = strtod(token, &end);
+  if(end==token || *end)
+    sceneFileFail(line, "expected a number for", what);
+
+  return value;
+}
+
+static vector_t sceneFileVector(sceneFileLine_t *line, const char *what){
+
+  dfloat x = sceneFileNumber(line, what);
+  dfloat y = sceneFileNumber(line, what);
+  dfloat z = sceneFileNumber(line, what);
+
+  return vectorCreate(x, y, z);
+}
+
+static colour_t sceneFileColour(sceneFileLine_t *line, const char *what){
+
+  colour_t c;
+  c.red   = sceneFileNumber(line, what);
+  c.green = sceneFileNumber(line, what);
+  c.blue  = sceneFileNumber(line, what);
+
+  return c;
+}
+
+// index of a named material
+static int sceneFileMaterial(sceneFileLine_t *line, const int Nmaterials, char **materialNames){
+
+  const char *name = sceneFileToken(line, "material name");
+
+  for(int m=0;m<Nmaterials;++m)
+    if(!strcmp(materialNames[m], name))
+      return m;
+
+  sceneFileFail(line, "unknown material", name);
+  return 0;
+}
+
+// room for one more entry in a growing array
+static void *sceneFileGrow(void *array, const int count, int *capacity, const size_t size){
+
+  if(count<*capacity) return array;
+
+  *capacity = max(2*(*capacity), 16);
+
+  return realloc(array, (*capacity)*size);
+}
+
+// rank 0 reads the whole file, every rank gets a copy of the text
+static char *sceneFileRead(MPI_Comm comm, const char *fileName){
+
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+
+  long length = 0;
+  char *text = NULL;
+
+  if(rank==0){
+    FILE *fp = fopen(fileName, "rb");
+    if(fp){
+      fseek(fp, 0, SEEK_END);
+      length = ftell(fp);
+      fseek(fp, 0, SEEK_SET);
+      text = (char*) calloc(length+1, sizeof(char));
+      if(fread(text, 1, length, fp)!=(size_t)length)
+	length = -1;
+      fclose(fp);
+    }
+    else
+      length = -1;
+  }
+
+  MPI_Bcast(&length, 1, MPI_LONG, 0, comm);
+
+  if(length<0){
+    if(rank==0)
+      printf("scene file %s could not be read\n", fileName);
+    MPI_Abort(comm, 1);
+  }
+
+  if(rank!=0)
+    text = (char*) calloc(length+1, sizeof(char));
+
+  MPI_Bcast(text, (int) length, MPI_CHAR, 0, comm);
+
+  return text;
+}
+
+// compose transform[3][4] with a rotation about axis (0, 1 or 2 for x, y, z) by degrees
+static void sceneFileRotate(dfloat transform[3][4], const int axis, const dfloat degrees){
+
+  const dfloat c = cos(degrees*M_PI/180.), s = sin(degrees*M_PI/180.);
+  const int a = (axis+1)%3, b = (axis+2)%3;
+
+  for(int n=0;n<4;++n){
+    const dfloat ta = transform[a][n], tb = transform[b][n];
+    transform[a][n] = c*ta - s*tb;
+    transform[b][n] = s*ta + c*tb;
+  }
+}
+
+// read a scene description into a scene (see notes above)
+scene_t *sceneFileSetup(MPI_Comm comm, const char *fileName){
+
+  char *text = sceneFileRead(comm, fileName);
+
+  // scene contents grow as items are read
+  int Nmaterials = 0, materialCapacity = 0;
+  material_t *materials = NULL;
+  char **materialNames = NULL;
+
+  int Nshapes = 0, shapeCapacity = 0;
+  shape_t *shapes = NULL;
+
+  int Nlights = 0, lightCapacity = 0;
+  light_t *lights = NULL;
+
+  mesh_t *mesh = (mesh_t*) calloc(1, sizeof(mesh_t));
+  int vertexCapacity = 0, faceCapacity = 0;
+
+  // mesh files already read
+  int NmeshFiles = 0, meshFileCapacity = 0;
+  mesh_t *meshFiles = NULL;
+  char **meshFileNames = NULL;
+
+  // world, grid and camera default to the generated scene
+  dfloat L = BOXSIZE, margin = 100;
+  int NI = 151, NJ = 151, NK = 151;
+  sensor_t sensor = sensorSetup();
+
+  sceneFileLine_t line;
+  line.fileName = fileName;
+  line.line = 0;
+
+  char *next = text;
+  while(next && *next){
+
+    // split off one line, drop the comment and split it into tokens
+    char *c = next;
+    next = strchr(c, '\n');
+    if(next) *(next++) = 0;
+    ++line.line;
+
+    char *comment = strchr(c, '#');
+    if(comment) *comment = 0;
+
+    line.Ntokens = 0;
+    line.next = 1;
+    char *save;
+    for(char *token=strtok_r(c, " \t\r", &save);token;token=strtok_r(NULL, " \t\r", &save)){
+      if(line.Ntokens==p_sceneMaxTokens)
+	sceneFileFail(&line, "too many tokens", NULL);
+      line.tokens[line.Ntokens++] = token;
+    }
+
+    if(!line.Ntokens) continue;
+
+    const char *keyword = line.tokens[0];
+
+    if(!strcmp(keyword, "material")){
+      materials = (material_t*) sceneFileGrow(materials, Nmaterials, &materialCapacity, sizeof(material_t));
+      materialNames = (char**) realloc(materialNames, materialCapacity*sizeof(char*));
+
+      material_t &m = materials[Nmaterials];
+      memset(&m, 0, sizeof(material_t));
+      m.diffuse.red = m.diffuse.green = m.diffuse.blue = 1;
+      m.eta = 1;
+
+      materialNames[Nmaterials++] = strdup(sceneFileToken(&line, "material name"));
+
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "diffuse"))      m.diffuse = sceneFileColour(&line, key);
+	else if(!strcmp(key, "reflect")){ m.reflection = sceneFileNumber(&line, key); m.info.reflector = 1; }
+	else if(!strcmp(key, "refract")){ m.refraction = sceneFileNumber(&line, key); m.info.refractor = 1; }
+	else if(!strcmp(key, "eta"))      m.eta = sceneFileNumber(&line, key);
+	else if(!strcmp(key, "emit"))     m.info.emitter = 1;
+	else sceneFileFail(&line, "unknown material property", key);
+      }
+
+      // as for the generated materials
+      if(!m.info.refractor && !m.info.reflector)
+	m.info.reflector = 1;
+    }
+    else if(!strcmp(keyword, "light")){
+      lights = (light_t*) sceneFileGrow(lights, Nlights, &lightCapacity, sizeof(light_t));
+
+      light_t &l = lights[Nlights++];
+      l.pos = vectorCreate(0, 0, 0);
+      l.intensity.red = l.intensity.green = l.intensity.blue = 1;
+
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "position"))    l.pos = sceneFileVector(&line, key);
+	else if(!strcmp(key, "colour")) l.intensity = sceneFileColour(&line, key);
+	else sceneFileFail(&line, "unknown light property", key);
+      }
+    }
+    else if(!strcmp(keyword, "sphere") || !strcmp(keyword, "cone") || !strcmp(keyword, "cylinder") ||
+	    !strcmp(keyword, "disk")   || !strcmp(keyword, "rectangle")){
+
+      // room for a cylinder and its two end disks
+      shapes = (shape_t*) sceneFileGrow(shapes, Nshapes+2, &shapeCapacity, sizeof(shape_t));
+
+      shape_t &s = shapes[Nshapes];
+      memset(&s, 0, sizeof(shape_t));
+
+      vector_t center = vectorCreate(0, 0, 0), axis = vectorCreate(0, 1, 0), axis1 = vectorCreate(0, 0, 1);
+      dfloat radius = 1, height = 1, length0 = 1, length1 = 1;
+      int capMaterial = -1;
+
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "center") || !strcmp(key, "apex") || !strcmp(key, "base"))
+	  center = sceneFileVector(&line, key);
+	else if(!strcmp(key, "axis") || !strcmp(key, "normal") || !strcmp(key, "axis0"))
+	  axis = sceneFileVector(&line, key);
+	else if(!strcmp(key, "axis1"))    axis1 = sceneFileVector(&line, key);
+	else if(!strcmp(key, "radius"))   radius = sceneFileNumber(&line, key);
+	else if(!strcmp(key, "height"))   height = sceneFileNumber(&line, key);
+	else if(!strcmp(key, "size")){    length0 = sceneFileNumber(&line, key); length1 = sceneFileNumber(&line, key); }
+	else if(!strcmp(key, "material")) s.material = sceneFileMaterial(&line, Nmaterials, materialNames);
+	else if(!strcmp(key, "caps"))     capMaterial = sceneFileMaterial(&line, Nmaterials, materialNames);
+	else sceneFileFail(&line, "unknown shape property", key);
+      }
+
+      if(vectorNorm(axis)<p_eps || vectorNorm(axis1)<p_eps)
+	sceneFileFail(&line, "zero axis for", keyword);
+
+      axis = vectorNormalize(axis);
+
+      if(!strcmp(keyword, "sphere")){
+	s.type = SPHERE;
+	s.sphere.pos = center;
+	s.sphere.radius = radius;
+      }
+      if(!strcmp(keyword, "cone")){
+	s.type = CONE;
+	s.cone.vertex = center;
+	s.cone.axis = axis;
+	s.cone.radius = radius;
+	s.cone.height = height;
+      }
+      if(!strcmp(keyword, "disk")){
+	s.type = DISK;
+	s.disk.center = center;
+	s.disk.normal = axis;
+	s.disk.radius = radius;
+      }
+      if(!strcmp(keyword, "rectangle")){
+	s.type = RECTANGLE;
+	s.rectangle.center = center;
+	s.rectangle.axis[0] = axis;
+	s.rectangle.axis[1] = vectorNormalize(axis1);
+	s.rectangle.length[0] = length0;
+	s.rectangle.length[1] = length1;
+      }
+      if(!strcmp(keyword, "cylinder")){
+	s.type = CYLINDER;
+	s.cylinder.center = center;
+	s.cylinder.axis = axis;
+	s.cylinder.radius = radius;
+	s.cylinder.height = height;
+      }
+
+      s.id = Nshapes;
+      ++Nshapes;
+
+      // end caps as in the generated scene
+      if(s.type==CYLINDER){
+	for(int cap=0;cap<2;++cap){
+	  shape_t &d = shapes[Nshapes];
+	  memset(&d, 0, sizeof(shape_t));
+	  d.type = DISK;
+	  d.disk.radius = radius;
+	  d.disk.normal = vectorScale(cap ? -1. : 1., axis);
+	  d.disk.center = cap ? vectorAdd(center, vectorScale(height, axis)) : center;
+	  d.material = (capMaterial>=0) ? capMaterial : s.material;
+	  d.id = Nshapes;
+	  ++Nshapes;
+	}
+      }
+    }
+    else if(!strcmp(keyword, "triangle") || !strcmp(keyword, "mesh")){
+
+      const int isMesh = !strcmp(keyword, "mesh");
+
+      // source vertices and faces, one triangle or a mesh file
+      meshVertex_t triangleVertices[3];
+      int triangleFaces[3] = {0, 1, 2};
+      mesh_t source;
+      source.Nvertices = 3;
+      source.vertices  = triangleVertices;
+      source.Nfaces    = 1;
+      source.faces     = triangleFaces;
+
+      int material = 0, Nvertices = 0;
+
+      // transform of the instance, applied to the vertices in order
+      dfloat transform[3][4] = {{1,0,0,0},{0,1,0,0},{0,0,1,0}};
+
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+
+	if(!strcmp(key, "material"))
+	  material = sceneFileMaterial(&line, Nmaterials, materialNames);
+	else if(!isMesh && !strcmp(key, "vertex") && Nvertices<3){
+	  vector_t v = sceneFileVector(&line, key);
+	  triangleVertices[Nvertices].x = v.x;
+	  triangleVertices[Nvertices].y = v.y;
+	  triangleVertices[Nvertices].z = v.z;
+	  ++Nvertices;
+	}
+	else if(isMesh && !strcmp(key, "file")){
+	  const char *name = sceneFileToken(&line, key);
+
+	  int f = 0;
+	  while(f<NmeshFiles && strcmp(meshFileNames[f], name)) ++f;
+
+	  if(f==NmeshFiles){
+	    meshFiles = (mesh_t*) sceneFileGrow(meshFiles, NmeshFiles, &meshFileCapacity, sizeof(mesh_t));
+	    meshFileNames = (char**) realloc(meshFileNames, meshFileCapacity*sizeof(char*));
+	    memset(meshFiles+f, 0, sizeof(mesh_t));
+	    bcastPlyModel(comm, name, meshFiles+f);
+	    meshFileNames[NmeshFiles++] = strdup(name);
+	  }
+
+	  source = meshFiles[f];
+	  Nvertices = 3;
+	}
+	else if(isMesh && !strcmp(key, "scale")){
+	  const dfloat scale = sceneFileNumber(&line, key);
+	  for(int i=0;i<3;++i)
+	    for(int j=0;j<4;++j)
+	      transform[i][j] *= scale;
+	}
+	else if(isMesh && !strcmp(key, "rotate")){
+	  const char *axis = sceneFileToken(&line, key);
+	  if(strlen(axis)!=1 || axis[0]<'x' || axis[0]>'z')
+	    sceneFileFail(&line, "rotate axis must be x, y or z not", axis);
+	  sceneFileRotate(transform, axis[0]-'x', sceneFileNumber(&line, key));
+	}
+	else if(isMesh && !strcmp(key, "translate")){
+	  vector_t t = sceneFileVector(&line, key);
+	  transform[0][3] += t.x;
+	  transform[1][3] += t.y;
+	  transform[2][3] += t.z;
+	}
+	else
+	  sceneFileFail(&line, "unknown property", key);
+      }
+
+      if(Nvertices<3)
+	sceneFileFail(&line, isMesh ? "no file for" : "three vertices needed for", keyword);
+
+      // append the transformed instance to the scene mesh
+      const int vertexOffset = mesh->Nvertices;
+      const int faceOffset   = mesh->Nfaces;
+
+      if(vertexOffset+source.Nvertices>vertexCapacity){
+	vertexCapacity = 2*(vertexOffset+source.Nvertices);
+	mesh->vertices = (meshVertex_t*) realloc(mesh->vertices, vertexCapacity*sizeof(meshVertex_t));
+      }
+
+      if(faceOffset+source.Nfaces>faceCapacity){
+	faceCapacity = 2*(faceOffset+source.Nfaces);
+	mesh->faces = (int*) realloc(mesh->faces, 3*faceCapacity*sizeof(int));
+	mesh->faceMaterials = (int*) realloc(mesh->faceMaterials, faceCapacity*sizeof(int));
+      }
+
+      for(int v=0;v<source.Nvertices;++v){
+	const meshVertex_t &p = source.vertices[v];
+	meshVertex_t &q = mesh->vertices[vertexOffset+v];
+	q.x = transform[0][0]*p.x + transform[0][1]*p.y + transform[0][2]*p.z + transform[0][3];
+	q.y = transform[1][0]*p.x + transform[1][1]*p.y + transform[1][2]*p.z + transform[1][3];
+	q.z = transform[2][0]*p.x + transform[2][1]*p.y + transform[2][2]*p.z + transform[2][3];
+      }
+
+      for(int f=0;f<source.Nfaces;++f){
+	for(int v=0;v<3;++v)
+	  mesh->faces[3*(faceOffset+f)+v] = vertexOffset + source.faces[3*f+v];
+	mesh->faceMaterials[faceOffset+f] = material;
+      }
+
+      mesh->Nvertices += source.Nvertices;
+      mesh->Nfaces    += source.Nfaces;
+    }
+    else if(!strcmp(keyword, "camera")){
+      int haveEye = 0, haveTarget = 0;
+      vector_t eye = sensor.eyeX, target = sensor.lensC;
+      dfloat focus = 0;
+      colour_t bg = sensor.bg;
+
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "eye")){             eye = sceneFileVector(&line, key); haveEye = 1; }
+	else if(!strcmp(key, "target")){     target = sceneFileVector(&line, key); haveTarget = 1; }
+	else if(!strcmp(key, "focus"))       focus = sceneFileNumber(&line, key);
+	else if(!strcmp(key, "background")) bg = sceneFileColour(&line, key);
+	else sceneFileFail(&line, "unknown camera property", key);
+      }
+
+      if(haveEye!=haveTarget)
+	sceneFileFail(&line, "camera needs both eye and target", NULL);
+
+      if(haveEye)
+	sensor = sensorLookAt(eye, target, focus);
+      sensor.bg = bg;
+    }
+    else if(!strcmp(keyword, "world")){
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "size"))        L = sceneFileNumber(&line, key);
+	else if(!strcmp(key, "margin")) margin = sceneFileNumber(&line, key);
+	else sceneFileFail(&line, "unknown world property", key);
+      }
+    }
+    else if(!strcmp(keyword, "grid")){
+      while(line.next<line.Ntokens){
+	const char *key = sceneFileToken(&line, NULL);
+	if(!strcmp(key, "cells")){
+	  NI = (int) sceneFileNumber(&line, key);
+	  NJ = (int) sceneFileNumber(&line, key);
+	  NK = (int) sceneFileNumber(&line, key);
+	  if(NI<1 || NJ<1 || NK<1)
+	    sceneFileFail(&line, "grid needs at least one cell in each direction", NULL);
+	}
+	else sceneFileFail(&line, "unknown grid property", key);
+      }
+    }
+    else
+      sceneFileFail(&line, "unknown keyword", keyword);
+  }
+
+  if(!Nmaterials){
+    printf("scene file %s has no materials\n", fileName);
+    exit(1);
+  }
+
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  if(rank==0)
+    printf("Read %d materials, %d shapes, %d triangles and %d lights from %s\n",
+	   Nmaterials, Nshapes, mesh->Nfaces, Nlights, fileName);
+
+  for(int f=0;f<NmeshFiles;++f){
+    free(meshFiles[f].vertices);
+    free(meshFiles[f].faces);
+    free(meshFileNames[f]);
+  }
+  free(meshFiles);
+  free(meshFileNames);
+
+  for(int m=0;m<Nmaterials;++m)
+    free(materialNames[m]);
+  free(materialNames);
+
+  free(text);
+
+  scene_t *scene = (scene_t*) calloc(1, sizeof(scene_t));
+  scene->Nmaterials = Nmaterials;
+  scene->materials  = materials;
+  scene->Nshapes    = Nshapes;
+  scene->shapes     = shapes;
+  scene->mesh       = mesh;
+  scene->Nlights    = Nlights;
+  scene->lights     = lights;
+  scene->grid       = sceneGridSetup(L, margin, NI, NJ, NK);
+  scene->sensor     = sensor;
+
+  return scene;
+}
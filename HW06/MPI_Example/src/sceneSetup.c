@@ -1,3 +1,4 @@
+#include <sys/mman.h>
 #include "simpleRayTracer.h"
 
 // set up scene to render
@@ -7,11 +8,143 @@
 //      [x,y,z] \in   [0,BOXSIZE] x [0,BOXSIZE] x [0,BOXSIZE]
 // b. with current viewport settings y=0 is the towards the top of the render
 // c. currently using 64 randomly generated materials
+// d. object counts, the sphere layout and the world size in x and z come from
+//    sceneOptions_t (defaults give the classic scene)
+// e. -scene file replaces the generated scene with a scene description file
+//    (see sceneFileSetup)
+
+// default scene, overridden by the command line options
+//   -spheres N -bunnies N -cones N -cylinders N
+//   -layout drop|lattice|jitter -radius R -world L -seed S
+//   -scene file (read the scene from a file, the options above are ignored)
+//   -cache file (reuse the built scene, see sceneCacheSetup)
+sceneOptions_t sceneParseOptions(int argc, char **argv){
+
+  sceneOptions_t options;
+
+  options.Nspheres   = 25;
+  options.Nbunnies   = 10;
+  options.Ncones     = 25;
+  options.Ncylinders = 25;
+  options.layout     = SCENE_DROP;
+  options.radius     = 35*SCALE;
+  options.L          = BOXSIZE;
+  options.seed       = 1;
+  options.sceneFile  = NULL;
+  options.cacheFile  = NULL;
+
+  // other options are left to the caller
+  for(int n=1;n<argc-1;++n){
+    if(!strcmp(argv[n], "-spheres"))   options.Nspheres   = atoi(argv[++n]);
+    else if(!strcmp(argv[n], "-bunnies"))   options.Nbunnies   = atoi(argv[++n]);
+    else if(!strcmp(argv[n], "-cones"))     options.Ncones     = atoi(argv[++n]);
+    else if(!strcmp(argv[n], "-cylinders")) options.Ncylinders = atoi(argv[++n]);
+    else if(!strcmp(argv[n], "-radius"))    options.radius     = atof(argv[++n]);
+    else if(!strcmp(argv[n], "-world"))     options.L          = atof(argv[++n]);
+    else if(!strcmp(argv[n], "-seed"))      options.seed       = atoi(argv[++n]);
+    else if(!strcmp(argv[n], "-scene"))     options.sceneFile  = argv[++n];
+    else if(!strcmp(argv[n], "-cache"))     options.cacheFile  = argv[++n];
+    else if(!strcmp(argv[n], "-layout")){
+      ++n;
+      if(!strcmp(argv[n], "drop"))    options.layout = SCENE_DROP;
+      if(!strcmp(argv[n], "lattice")) options.layout = SCENE_LATTICE;
+      if(!strcmp(argv[n], "jitter"))  options.layout = SCENE_JITTER;
+    }
+  }
+
+  return options;
+}
+
+// smallest n with n*n >= N
+static int sceneSide(const int N){
+
+  int n = (int) sqrt((double)N);
+  while(n*n<N) ++n;
+
+  return max(n, 1);
+}
+
+// place sphere i of the lattice layouts, layers of nx*nz lattice sites are
+// stacked upwards from half way down the world
+static void sceneLatticeSphere(const sceneOptions_t *options, const int i,
+			       unsigned short *rng, sphere_t *sphere){
+
+  const int jitter = (options->layout==SCENE_JITTER);
+
+  // site size fits the largest sphere with a small gap
+  const dfloat rmax  = jitter ? 1.5*options->radius : options->radius;
+  const dfloat space = 2.2*rmax;
+
+  const int nx = max((int)(options->L/space), 1);
+  const int nz = nx;
+
+  const int ix = i%nx;
+  const int iz = (i/nx)%nz;
+  const int iy = i/(nx*nz);
+
+  sphere->radius = jitter ? options->radius*(1 + 0.5*erand48(rng)) : options->radius;
+
+  sphere->pos.x = (ix+0.5)*space;
+  sphere->pos.z = (iz+0.5)*space;
+  sphere->pos.y = HEIGHT/2 - (iy+0.5)*space;
+
+  // move within the site without touching the neighbours
+  if(jitter){
+    const dfloat slack = 0.5*space - sphere->radius;
+    sphere->pos.x += slack*(2*erand48(rng)-1);
+    sphere->pos.y += slack*(2*erand48(rng)-1);
+    sphere->pos.z += slack*(2*erand48(rng)-1);
+  }
+}
+
+// regular render grid over [0,L] x [0,HEIGHT] x [0,L] widened by margin on every side
+grid_t *sceneGridSetup(const dfloat L, const dfloat margin, const int NI, const int NJ, const int NK){
+
+  grid_t *grid = (grid_t*) calloc(1, sizeof(grid_t));
+  grid->xmin = -margin;
+  grid->xmax = L + margin;
+  grid->ymin = -margin;
+  grid->ymax = HEIGHT + margin;
+  grid->zmin = -margin;
+  grid->zmax = L + margin;
+
+  grid->NI = NI;
+  grid->NJ = NJ;
+  grid->NK = NK;
+
+  grid->dx = (grid->xmax-grid->xmin)/grid->NI;
+  grid->dy = (grid->ymax-grid->ymin)/grid->NJ;
+  grid->dz = (grid->zmax-grid->zmin)/grid->NK;
+  
+  grid->invdx = grid->NI/(grid->xmax-grid->xmin);
+  grid->invdy = grid->NJ/(grid->ymax-grid->ymin);
+  grid->invdz = grid->NK/(grid->zmax-grid->zmin);
+
+  grid->bboxes = (bbox_t*) calloc(grid->NI*grid->NJ*grid->NK, sizeof(bbox_t));
+  for(int k=0;k<grid->NK;++k){
+    for(int j=0;j<grid->NJ;++j){
+      for(int i=0;i<grid->NI;++i){
+	int id = i + j*grid->NI + k*grid->NI*grid->NJ;
+	grid->bboxes[id].xmin = i*grid->dx + grid->xmin;
+	grid->bboxes[id].xmax = (i+1)*grid->dx + grid->xmin;
+	grid->bboxes[id].ymin = j*grid->dy + grid->ymin;
+	grid->bboxes[id].ymax = (j+1)*grid->dy + grid->ymin;
+	grid->bboxes[id].zmin = k*grid->dz + grid->zmin;
+	grid->bboxes[id].zmax = (k+1)*grid->dz + grid->zmin;
+      }
+    }
+  }
+
+  return grid;
+}
 
-scene_t *sceneSetup(){
+scene_t *sceneSetup(const sceneOptions_t *options){
   int i;
 
-  dfloat L = BOXSIZE;
+  if(options->sceneFile)
+    return sceneFileSetup(MPI_COMM_WORLD, options->sceneFile);
+
+  dfloat L = options->L;
   
   int Nmaterials = 64;
   material_t *materials = (material_t*) calloc(Nmaterials, sizeof(material_t));
@@ -55,56 +188,64 @@ scene_t *sceneSetup(){
     }
   }
 
-  // read bunny.ply 
-  int Ntriangles; 
-  triangle_t *triangles;
-  readPlyModel("bunny.ply", &Ntriangles, &triangles);
+  // read bunny.ply on rank 0 and broadcast to the other ranks
+  mesh_t bunny;
+  bcastPlyModel(MPI_COMM_WORLD, p_bunnyFile, &bunny);
 
-  int Nbunny = 10;   // will use 10 copies of bunny
-  int Nspheres = 5; // 100 random spheres
-  int Ncones = 5;    // 20 random cones
-  int Ncylinders = 5;// 20 random cylinders
+  int Nbunny = options->Nbunnies;
+  int NtotalSpheres = options->Nspheres;
+  int NtotalCones = options->Ncones;
+  int NtotalCylinders = options->Ncylinders;
   int Nrectangles = 1;// 1  ground plane rectangle
 
-  int Nshapes = Nspheres*Nspheres + Nbunny*Ntriangles + Ncones*Ncones + 3*Ncylinders*Ncylinders + Nrectangles; // each cylinder has two end disks
+  // classic layouts place objects in rows of this many
+  int Nspheres = sceneSide(NtotalSpheres);
+  int Ncones = sceneSide(NtotalCones);
+  int Ncylinders = sceneSide(NtotalCylinders);
+
+  // bunny triangles are kept in an indexed mesh, not in shapes
+  int Nshapes = NtotalSpheres + NtotalCones + 3*NtotalCylinders + Nrectangles; // each cylinder has two end disks
 
   shape_t *shapes = (shape_t*) calloc(Nshapes, sizeof(shape_t));
 
-  // clone the bunny Nbunny times
-  int bcnt = 0;
+  // clone the bunny Nbunny times, each clone has its own vertices
+  mesh_t *mesh = (mesh_t*) calloc(1, sizeof(mesh_t));
+  mesh->Nvertices = Nbunny*bunny.Nvertices;
+  mesh->Nfaces    = Nbunny*bunny.Nfaces;
+  mesh->vertices  = (meshVertex_t*) calloc(mesh->Nvertices, sizeof(meshVertex_t));
+  mesh->faces     = (int*) calloc(3*mesh->Nfaces, sizeof(int));
+
+  // choose material for bunny
+  mesh->material = 10;
+
   for(int b=0;b<Nbunny;++b){
     dfloat boffx = 50*(Nbunny-b)/(double)Nbunny + (L-50)*b/(double)Nbunny;
     dfloat boffy = 50;
     dfloat boffz = 50*cos(b)*cos(b) + (L-50)*sin(b)*sin(b);
     dfloat bscal = .2*cbrt(SCALE);
-    for(i=0;i<Ntriangles;++i){
-      shapes[bcnt].triangle = triangles[i];
-
-      // scale and rotate bunny onto ground plane
-      for(int v=0;v<3;++v){
-	shapes[bcnt].triangle.vertices[v].x *= bscal;
-	shapes[bcnt].triangle.vertices[v].y = HEIGHT - bscal*(HEIGHT-shapes[bcnt].triangle.vertices[v].y);
-	shapes[bcnt].triangle.vertices[v].z *= bscal;
-
-	shapes[bcnt].triangle.vertices[v].x += boffx;
-	shapes[bcnt].triangle.vertices[v].z += boffz;
-      }
 
-      // choose material for bunny
-      shapes[bcnt].material = 10;
-      shapes[bcnt].type = TRIANGLE;
-      shapes[bcnt].id = bcnt;
-      ++bcnt;
+    // scale and rotate bunny onto ground plane
+    for(int v=0;v<bunny.Nvertices;++v){
+      const meshVertex_t &vertex = bunny.vertices[v];
+      meshVertex_t &clone = mesh->vertices[b*bunny.Nvertices + v];
+      clone.x = bscal*vertex.x + boffx;
+      clone.y = HEIGHT - bscal*(HEIGHT-vertex.y);
+      clone.z = bscal*vertex.z + boffz;
     }
+
+    for(i=0;i<3*bunny.Nfaces;++i)
+      mesh->faces[3*b*bunny.Nfaces + i] = b*bunny.Nvertices + bunny.faces[i];
   }
 
-  Ntriangles *= Nbunny;
-  printf("Ntriangles = %d\n", Ntriangles);
+  free(bunny.vertices);
+  free(bunny.faces);
+
+  printf("Ntriangles = %d\n", mesh->Nfaces);
 
-  int cnt = Ntriangles;
+  int cnt = 0;
 
   // generate random cones
-  for(i=0;i<Ncones*Ncones;++i){
+  for(i=0;i<NtotalCones;++i){
 
     shapes[cnt].cone.radius = 140*SCALE;
     shapes[cnt].cone.height = 280*SCALE;
@@ -117,7 +258,7 @@ scene_t *sceneSetup(){
     shapes[cnt].cone.vertex.y = HEIGHT; // -shapes[cnt].cone.height;
     shapes[cnt].cone.vertex.z = L - L*((i+1)%Ncones)/(double)Ncones;
     
-    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/(Ncones*Ncones));
+    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/NtotalCones);
     shapes[cnt].type = CONE;
     shapes[cnt].id = cnt;
     ++cnt;
@@ -125,28 +266,36 @@ scene_t *sceneSetup(){
   }
 
   // generate random spheres
-  for(i=0;i<Nspheres*Nspheres;++i){
-    
-    shapes[cnt].sphere.radius = SCALE*(35 + i/5);
+  dfloat top = HEIGHT;
+  unsigned short rng[3] = {0x330e, (unsigned short) options->seed, (unsigned short)(options->seed>>16)};
+  for(i=0;i<NtotalSpheres;++i){
+
+    if(options->layout==SCENE_DROP){
+      shapes[cnt].sphere.radius = options->radius + SCALE*((i/5)%5);
 
-    shapes[cnt].sphere.pos.x = L*((21*i+1)%Nspheres)/(double)Nspheres;
-    shapes[cnt].sphere.pos.y = HEIGHT/8-shapes[cnt].sphere.radius;
-    shapes[cnt].sphere.pos.z = 0.1*L*((11*i+1)/Nspheres)/(double)Nspheres;
+      shapes[cnt].sphere.pos.x = L*((21*i+1)%Nspheres)/(double)Nspheres;
+      shapes[cnt].sphere.pos.y = HEIGHT/8-shapes[cnt].sphere.radius;
+      shapes[cnt].sphere.pos.z = 0.1*L*((11*i+1)/Nspheres)/(double)Nspheres;
     
-    shapes[cnt].sphere.pos.y += i + 50; // drop from up to 150 pixels
+      shapes[cnt].sphere.pos.y += (i%100) + 50; // drop from up to 150 pixels
+    }
+    else
+      sceneLatticeSphere(options, i, rng, &(shapes[cnt].sphere));
 
-    shapes[cnt].sphere.velocity = vectorCreate(0,0,0);
-    shapes[cnt].sphere.newVelocity = vectorCreate(0,0,0);
+    top = min(top, shapes[cnt].sphere.pos.y - shapes[cnt].sphere.radius);
 
-    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/(Nspheres*Nspheres));
+    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/NtotalSpheres);
     shapes[cnt].type = SPHERE;
     shapes[cnt].id = cnt;
     ++cnt;
     
   }
 
+  if(top<0)
+    printf("sceneSetup: warning spheres start %g above the world, use fewer spheres, a smaller -radius or a larger -world\n", -top);
+
   // generate random cylinders
-  for(i=0;i<Ncylinders*Ncylinders;++i){
+  for(i=0;i<NtotalCylinders;++i){
 
     shapes[cnt].cylinder.radius = 100*SCALE;
     shapes[cnt].cylinder.height = 380*SCALE;
@@ -160,7 +309,7 @@ scene_t *sceneSetup(){
     shapes[cnt].cylinder.center.y = HEIGHT - shapes[cnt].cylinder.height;
     shapes[cnt].cylinder.center.z =  L - L*((7*i+1)%Ncylinders)/(double)Ncylinders;
     
-    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/(Ncylinders*Ncylinders));
+    shapes[cnt].material = 1 + (Nmaterials-2)*((double)i/NtotalCylinders);
     shapes[cnt].type = CYLINDER;
     shapes[cnt].id = cnt;
     ++cnt;
@@ -251,41 +400,7 @@ scene_t *sceneSetup(){
   lights[4].intensity.blue = 1;
 
   // sort the objects into a regular grid for faster look up
-  grid_t *grid = (grid_t*) calloc(1, sizeof(grid_t));
-  dfloat delta = 100;
-  grid->xmin = -delta;
-  grid->xmax = L + delta;
-  grid->ymin = -delta;
-  grid->ymax = HEIGHT + delta;
-  grid->zmin = -delta;
-  grid->zmax = L + delta;
-
-  grid->NI = 151;
-  grid->NJ = 151;
-  grid->NK = 151;
-
-  grid->dx = (grid->xmax-grid->xmin)/grid->NI;
-  grid->dy = (grid->ymax-grid->ymin)/grid->NJ;
-  grid->dz = (grid->zmax-grid->zmin)/grid->NK;
-  
-  grid->invdx = grid->NI/(grid->xmax-grid->xmin);
-  grid->invdy = grid->NJ/(grid->ymax-grid->ymin);
-  grid->invdz = grid->NK/(grid->zmax-grid->zmin);
-
-  grid->bboxes = (bbox_t*) calloc(grid->NI*grid->NJ*grid->NK, sizeof(bbox_t));
-  for(int k=0;k<grid->NK;++k){
-    for(int j=0;j<grid->NJ;++j){
-      for(int i=0;i<grid->NI;++i){
-	int id = i + j*grid->NI + k*grid->NI*grid->NJ;
-	grid->bboxes[id].xmin = i*grid->dx + grid->xmin;
-	grid->bboxes[id].xmax = (i+1)*grid->dx + grid->xmin;
-	grid->bboxes[id].ymin = j*grid->dy + grid->ymin;
-	grid->bboxes[id].ymax = (j+1)*grid->dy + grid->ymin;
-	grid->bboxes[id].zmin = k*grid->dz + grid->zmin;
-	grid->bboxes[id].zmax = (k+1)*grid->dz + grid->zmin;
-      }
-    }
-  }
+  grid_t *grid = sceneGridSetup(L, 100, 151, 151, 151);
 
   // capture all elements into the scene
   scene_t *scene = (scene_t*) calloc(1, sizeof(scene_t));
@@ -293,9 +408,43 @@ scene_t *sceneSetup(){
   scene->lights   = lights;
   scene->Nshapes   = Nshapes;
   scene->shapes   = shapes;
+  scene->mesh     = mesh;
   scene->Nmaterials = Nmaterials;
   scene->materials  = materials;
   scene->grid = grid;
+  scene->sensor = sensorSetup();
   
   return scene;
 }
+
+void sceneFree(scene_t *scene){
+
+  grid_t *grid = scene->grid;
+
+  free(grid->sphereStarts);
+  free(grid->sphereContents);
+  free(grid->sphereCounters);
+
+  // arrays of a cached scene live in the cache mapping
+  if(scene->cache){
+    munmap(scene->cache, scene->cacheSize);
+    free(grid);
+    free(scene->mesh);
+    free(scene);
+    return;
+  }
+
+  free(grid->bboxes);
+  free(grid->boxStarts);
+  free(grid->boxContents);
+  free(grid->faceStarts);
+  free(grid->faceContents);
+  free(grid);
+
+  meshFree(scene->mesh);
+
+  free(scene->materials);
+  free(scene->shapes);
+  free(scene->lights);
+  free(scene);
+}
@@ -0,0 +1,196 @@
+#include "simpleRayTracer.h"
+
+// narrow band distance field of the static shapes, sampled at the corners of
+// the static grid cells
+// Notes:
+//
+// a. distances are unsigned: the bunny is a triangle soup without a reliable
+//    orientation, and collisions only need the distance and direction to the
+//    nearest surface
+// b. distances beyond the band (largest sphere radius plus one cell) are
+//    clamped to the band, spheres only collide when closer than their radius
+// c. nodes next to occupied cells get exact distances to the shapes in those
+//    cells, then the closest shape of each node is propagated to its
+//    neighbours until the band is filled (a closest point transform)
+
+static int sdfNode(const sdf_t *sdf, const int i, const int j, const int k){
+  return i + sdf->NI*(j + sdf->NJ*k);
+}
+
+static vector_t sdfNodeLocation(const sdf_t *sdf, const int i, const int j, const int k){
+  return vectorCreate(sdf->xmin + i*sdf->dx, sdf->ymin + j*sdf->dy, sdf->zmin + k*sdf->dz);
+}
+
+sdf_t *sdfSetup(const grid_t *staticGrid, const int Nshapes, const shape_t *shapes){
+
+  sdf_t *sdf = (sdf_t*) calloc(1, sizeof(sdf_t));
+
+  // one node per cell corner
+  sdf->NI = staticGrid->NI+1;
+  sdf->NJ = staticGrid->NJ+1;
+  sdf->NK = staticGrid->NK+1;
+  sdf->xmin = staticGrid->xmin;
+  sdf->ymin = staticGrid->ymin;
+  sdf->zmin = staticGrid->zmin;
+  sdf->dx = staticGrid->dx;
+  sdf->dy = staticGrid->dy;
+  sdf->dz = staticGrid->dz;
+
+  dfloat maxRadius = 0;
+  for(int n=0;n<Nshapes;++n)
+    if(shapes[n].type==SPHERE)
+      maxRadius = max(maxRadius, shapes[n].sphere.radius);
+
+  sdf->band = maxRadius + max(sdf->dx, max(sdf->dy, sdf->dz));
+
+  const int NI = sdf->NI, NJ = sdf->NJ, NK = sdf->NK;
+  const int Nnodes = NI*NJ*NK;
+
+  sdf->dist = (float*) calloc(Nnodes, sizeof(float));
+
+  int *closest    = (int*) calloc(Nnodes, sizeof(int));
+  int *newClosest = (int*) calloc(Nnodes, sizeof(int));
+
+  // 1. exact distance from nodes to the shapes in the (up to) 8 cells sharing the node
+#pragma omp parallel for
+  for(int k=0;k<NK;++k){
+    for(int j=0;j<NJ;++j){
+      for(int i=0;i<NI;++i){
+	const int node = sdfNode(sdf, i, j, k);
+	const vector_t p = sdfNodeLocation(sdf, i, j, k);
+
+	dfloat mindist = sdf->band;
+	closest[node] = -1;
+
+	for(int ck=max(k-1,0);ck<=min(k,staticGrid->NK-1);++ck){
+	  for(int cj=max(j-1,0);cj<=min(j,staticGrid->NJ-1);++cj){
+	    for(int ci=max(i-1,0);ci<=min(i,staticGrid->NI-1);++ci){
+	      const int cellID = ci + staticGrid->NI*cj + staticGrid->NI*staticGrid->NJ*ck;
+
+	      // mesh faces (ids from Nshapes on, see gridShape), then static shapes
+	      for(int part=0;part<2;++part){
+		const int *starts   = part ? staticGrid->boxStarts   : staticGrid->faceStarts;
+		const int *contents = part ? staticGrid->boxContents : staticGrid->faceContents;
+		if(!starts) continue;
+
+		for(int offset=starts[cellID];offset<starts[cellID+1];++offset){
+		  const int id = part ? contents[offset] : Nshapes+contents[offset];
+		  vector_t c;
+		  dfloat dist = projectPointShape(p, gridShape(*staticGrid, Nshapes, shapes, id), &c);
+		  if(dist<mindist){
+		    mindist = dist;
+		    closest[node] = id;
+		  }
+		}
+	      }
+	    }
+	  }
+	}
+	sdf->dist[node] = mindist;
+      }
+    }
+  }
+
+  // 2. propagate closest shapes to neighbouring nodes until the band is covered
+  const int Npasses = 1 + (int) ceil(sdf->band/min(sdf->dx, min(sdf->dy, sdf->dz)));
+  for(int pass=0;pass<Npasses;++pass){
+
+    int changed = 0;
+
+#pragma omp parallel for reduction(+:changed)
+    for(int k=0;k<NK;++k){
+      for(int j=0;j<NJ;++j){
+	for(int i=0;i<NI;++i){
+	  const int node = sdfNode(sdf, i, j, k);
+	  const vector_t p = sdfNodeLocation(sdf, i, j, k);
+
+	  newClosest[node] = closest[node];
+
+	  const int neighbours[6][3] = {{i-1,j,k},{i+1,j,k},{i,j-1,k},{i,j+1,k},{i,j,k-1},{i,j,k+1}};
+	  for(int n=0;n<6;++n){
+	    const int ni = neighbours[n][0], nj = neighbours[n][1], nk = neighbours[n][2];
+	    if(ni<0 || ni>=NI || nj<0 || nj>=NJ || nk<0 || nk>=NK) continue;
+
+	    const int id = closest[sdfNode(sdf, ni, nj, nk)];
+	    if(id==-1 || id==newClosest[node]) continue;
+
+	    vector_t c;
+	    dfloat dist = projectPointShape(p, gridShape(*staticGrid, Nshapes, shapes, id), &c);
+	    if(dist<sdf->dist[node]){
+	      sdf->dist[node] = dist;
+	      newClosest[node] = id;
+	      ++changed;
+	    }
+	  }
+	}
+      }
+    }
+
+    int *tmp = closest;
+    closest = newClosest;
+    newClosest = tmp;
+
+    if(!changed) break;
+  }
+
+  free(closest);
+  free(newClosest);
+
+  return sdf;
+}
+
+// trilinearly interpolated distance to the static shapes at p, with the unit
+// gradient (direction away from the nearest surface) in normal
+dfloat sdfDistance(const sdf_t *sdf, const vector_t p, vector_t *normal){
+
+  *normal = vectorCreate(0,0,0);
+
+  // local coordinates of p in the lattice
+  const dfloat x = (p.x-sdf->xmin)/sdf->dx;
+  const dfloat y = (p.y-sdf->ymin)/sdf->dy;
+  const dfloat z = (p.z-sdf->zmin)/sdf->dz;
+
+  const int i = (int) floor(x);
+  const int j = (int) floor(y);
+  const int k = (int) floor(z);
+
+  // outside the lattice there is no static geometry
+  if(i<0 || i>=sdf->NI-1 || j<0 || j>=sdf->NJ-1 || k<0 || k>=sdf->NK-1)
+    return sdf->band;
+
+  const dfloat r = x-i, s = y-j, t = z-k;
+
+  const float *d = sdf->dist;
+  const dfloat d000 = d[sdfNode(sdf,i  ,j  ,k  )], d100 = d[sdfNode(sdf,i+1,j  ,k  )];
+  const dfloat d010 = d[sdfNode(sdf,i  ,j+1,k  )], d110 = d[sdfNode(sdf,i+1,j+1,k  )];
+  const dfloat d001 = d[sdfNode(sdf,i  ,j  ,k+1)], d101 = d[sdfNode(sdf,i+1,j  ,k+1)];
+  const dfloat d011 = d[sdfNode(sdf,i  ,j+1,k+1)], d111 = d[sdfNode(sdf,i+1,j+1,k+1)];
+
+  // interpolate in x, then y, then z
+  const dfloat d00 = d000 + r*(d100-d000);
+  const dfloat d10 = d010 + r*(d110-d010);
+  const dfloat d01 = d001 + r*(d101-d001);
+  const dfloat d11 = d011 + r*(d111-d011);
+
+  const dfloat d0 = d00 + s*(d10-d00);
+  const dfloat d1 = d01 + s*(d11-d01);
+
+  const dfloat dist = d0 + t*(d1-d0);
+
+  // analytic gradient of the trilinear interpolant
+  vector_t grad;
+  grad.x = ((1-s)*(1-t)*(d100-d000) + s*(1-t)*(d110-d010) + (1-s)*t*(d101-d001) + s*t*(d111-d011))/sdf->dx;
+  grad.y = ((1-t)*(d10-d00) + t*(d11-d01))/sdf->dy;
+  grad.z = (d1-d0)/sdf->dz;
+
+  *normal = vectorNormalize(grad);
+
+  return dist;
+}
+
+void sdfFree(sdf_t *sdf){
+
+  if(!sdf->cached)
+    free(sdf->dist);
+  free(sdf);
+}
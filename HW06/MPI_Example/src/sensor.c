@@ -1,5 +1,96 @@
 #include "simpleRayTracer.h"
 
+// camera looking at the world box from above the front edge
+sensor_t sensorSetup(){
+
+  // 1. location of observer eye (before rotation)
+  sensor_t sensor;
+
+  // background color
+  sensor.bg.red   = 126./256;
+  sensor.bg.green = 192./256;
+  sensor.bg.blue  = 238./256;
+
+  dfloat br = 3.75;
+
+  // angle elevation to y-z plane
+  dfloat eyeAngle = M_PI/4.f; // 0 is above, pi/2 is from side.  M_PI/3; 0; M_PI/2.;
+
+  // target view
+  vector_t targetX = vectorCreate(BOXSIZE/2, HEIGHT, BOXSIZE); // this I do not understand why target -B/2
+  sensor.eyeX = vectorAdd(targetX, vectorCreate(0, -br*HEIGHT*cos(eyeAngle), -br*BOXSIZE*sin(eyeAngle))); 
+  dfloat sensorAngle = eyeAngle +5.*M_PI/180.;
+  sensor.Idir   = vectorCreate(1.f, 0.f, 0.f);
+  sensor.Jdir   = vectorCreate(0.f, sin(sensorAngle), -cos(sensorAngle));
+  vector_t sensorNormal = vectorCrossProduct(sensor.Idir, sensor.Jdir);
+  
+  // 2.4 length of sensor in axis 1 & 2
+  sensor.Ilength = 25.0f;
+  sensor.Jlength = HEIGHT*(25.0f)/WIDTH;
+  sensor.offset  = 0.f;
+
+  // 2.5 normal distance from sensor to focal plane
+  dfloat lensOffset = 50;
+  sensor.lensC = vectorAdd(sensor.eyeX, vectorScale(lensOffset, vectorCrossProduct(sensor.Idir, sensor.Jdir)));
+
+  // why 0.25 ?
+  sensor.focalPlaneOffset = 0.22f*fabs(vectorTripleProduct(sensor.Idir, sensor.Jdir, vectorSub(targetX,sensor.eyeX))); // triple product
+  
+  //  sensor.focalOffset = 0.8*BOXSIZE - sensor.lensC.z; // needs to be distance to plane from sensor
+
+  printf("lensOffset = %g, sensor.focalPlaneOffset = %g\n", lensOffset, sensor.focalPlaneOffset);
+
+  return sensor;
+}
+
+// camera at eye looking at target, the screen is level (horizontal direction in
+// the x-z plane) and the focal plane is focus in front of the eye (at the target if focus<=0)
+sensor_t sensorLookAt(const vector_t eye, const vector_t target, const dfloat focus){
+
+  sensor_t sensor;
+
+  // background color and sensor size as in sensorSetup
+  sensor.bg.red   = 126./256;
+  sensor.bg.green = 192./256;
+  sensor.bg.blue  = 238./256;
+
+  sensor.Ilength = 25.0f;
+  sensor.Jlength = HEIGHT*(25.0f)/WIDTH;
+  sensor.offset  = 0.f;
+
+  vector_t view = vectorNormalize(vectorSub(target, eye));
+
+  // y points down the screen, looking straight up or down keeps x across
+  vector_t across = vectorCrossProduct(vectorCreate(0, 1, 0), view);
+  sensor.Idir = (vectorNorm(across)>p_eps) ? vectorNormalize(across) : vectorCreate(1, 0, 0);
+  sensor.Jdir = vectorCrossProduct(view, sensor.Idir);
+  sensor.eyeX = eye;
+
+  dfloat lensOffset = 50;
+  sensor.lensC = vectorAdd(eye, vectorScale(lensOffset, view));
+
+  // offset of the focal plane along the view direction
+  dfloat distance = (focus>0) ? focus : vectorDot(view, vectorSub(target, eye));
+  sensor.focalPlaneOffset = vectorDot(view, eye) + distance;
+
+  return sensor;
+}
+
+// unit directions in the lens plane, one pair per lens sample
+dfloat *sensorRandomNumbers(){
+
+  dfloat *randomNumbers = (dfloat*) calloc(2*NRANDOM, sizeof(dfloat));
+  for(int i=0;i<NRANDOM;++i){
+    dfloat r1 = 2*drand48()-1;
+    dfloat r2 = 2*drand48()-1;
+
+    randomNumbers[2*i+0] = r1/sqrt(r1*r1+r2*r2);
+    randomNumbers[2*i+1] = r2/sqrt(r1*r1+r2*r2);
+  }
+
+  return randomNumbers;
+}
+
 vector_t sensorLocation(const int NI,
 			const int NJ,
 			const int I,
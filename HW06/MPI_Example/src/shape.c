@@ -141,7 +141,7 @@ material_t shapeComputeMaterial(const int Nmaterials, const material_t *material
       int i = (int) (8.f*(h1/L1)); // checkerboard material selector
       int j = (int) (8.f*(h2/L2));
       
-      int idM = 2*((i%2) ^ ((j+1)%2)); // 1 if either i is odd or j is even
+      int idM = ((i%2) ^ ((j+1)%2)) ? s.material : 0; // 1 if either i is odd or j is even
       //      printf("i=%d, j=%d, h1=%g, h2=%g, L1=%g, L2=%g, idM = %d\n", i, j, h1, h2, L1, L2, idM);
       m = materials[idM];
     }
@@ -4,93 +4,209 @@
 // gcc -O3 -o simpleRayTracer *.c -I.  -fopenmp -lm
 
 // to run:
-//  ./simpleRayTracer
+//  mpiexec -n 4 ./simpleRayTracer [-gather | -qoi | -y4m file | -rgb file] [-ring]
+//                                  [-checkpoint N] [-restart file] [-end F]
+//                                  [-capture file [-captureEvery N]] [scene options]
+//
+//  by default each rank writes its own rows of every frame with MPI-IO,
+//  -gather collects the rows on rank 0 which writes the whole frame
+//
+//  -qoi writes lossless compressed images/image_%05d.qoi files instead, each
+//  rank compresses its own rows (ffmpeg and most image viewers read QOI)
+//
+//  -y4m and -rgb append all frames to one YUV4MPEG2 or raw RGB stream instead
+//  of writing images/image_%05d.ppm files, a file name of - writes to stdout:
+//    mpiexec -n 4 ./simpleRayTracer -y4m - | ffmpeg -y -i - foo.mp4
+//    mpiexec -n 4 ./simpleRayTracer -rgb - | ffmpeg -y -f rawvideo -pix_fmt rgb24 -s 2048x1440 -i - foo.mp4
+//
+//  scene options (see sceneParseOptions) change the object counts, sphere
+//  layout and world size, e.g. -spheres 10000 -layout lattice -radius 8
+//
+//  -scene file reads the materials, objects, lights, camera and grid from a
+//  scene description file instead (see sceneFileSetup and scenes/example.scene)
+//
+//  -cache scene.cache keeps the built scene, grid and distance field in a file
+//  that later runs with the same scene options map instead of rebuilding
+//
+//  with OMP_NUM_THREADS>1 thread 0 of each rank writes or sends finished rows
+//  while the other threads render
+//
+//  -ring keeps only a ring of row bands per rank instead of all its rows, rows
+//  are written (or sent) as soon as their band is done and the slots reused,
+//  so the memory of a rank stays bounded for very large images (not for -qoi)
+//
+//  -checkpoint N saves the sphere state to checkpoints/checkpoint_%05d.bin at
+//  the start of every N-th frame, -restart file continues from such a file and
+//  -end F stops before frame F, so a frame range can be re-rendered or a long
+//  sequence split across jobs:
+//    mpiexec -n 4 ./simpleRayTracer -checkpoint 5 -end 5
+//    mpiexec -n 4 ./simpleRayTracer -restart checkpoints/checkpoint_00005.bin
+//  (restarting on a different number of ranks works but the contact solver
+//  starts cold, so the frames differ slightly from an uninterrupted run)
+//
+//  -capture file records the rays traced for one in every N (default
+//  p_captureEvery) lens samples of the first frame rendered, with the sphere
+//  state of that frame, for the replay driver (see replay.c), combine with
+//  -restart to capture a later frame
 
 // to compile animation:
 //   ffmpeg -y -i image_%05d.ppm -pix_fmt yuv420p foo.mp4
 
 int main(int argc, char *argv[]){
 
-  MPI_Init(&argc, &argv);
+  // only the master thread of each rank makes MPI calls
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   
   int rank;
   int size;
   
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  if(rank==0 && provided<MPI_THREAD_FUNNELED)
+    printf("warning: MPI library does not support MPI_THREAD_FUNNELED\n");
+
+  // choose how frames are written
+  int outputMode = OUTPUT_MPIIO;
+  int ring = 0;
+  const char *streamName = NULL;
+
+  // checkpoint every checkpointEvery frames (0 for never), restart from restartName
+  int checkpointEvery = 0;
+  int endFrame = -1;
+  const char *restartName = NULL;
+
+  // capture the rays of the first frame rendered to captureName
+  const char *captureName = NULL;
+  int captureEvery = p_captureEvery;
+  for(int n=1;n<argc;++n){
+    if(!strcmp(argv[n], "-gather"))
+      outputMode = OUTPUT_GATHER;
+    if(!strcmp(argv[n], "-qoi"))
+      outputMode = OUTPUT_QOI;
+    if(!strcmp(argv[n], "-ring"))
+      ring = 1;
+    if(n<argc-1 && !strcmp(argv[n], "-checkpoint"))
+      checkpointEvery = atoi(argv[++n]);
+    else if(n<argc-1 && !strcmp(argv[n], "-restart"))
+      restartName = argv[++n];
+    else if(n<argc-1 && !strcmp(argv[n], "-end"))
+      endFrame = atoi(argv[++n]);
+    else if(n<argc-1 && !strcmp(argv[n], "-capture"))
+      captureName = argv[++n];
+    else if(n<argc-1 && !strcmp(argv[n], "-captureEvery"))
+      captureEvery = atoi(argv[++n]);
+    if(n<argc-1 && !strcmp(argv[n], "-y4m")){
+      outputMode = OUTPUT_Y4M;
+      streamName = argv[++n];
+    }
+    else if(n<argc-1 && !strcmp(argv[n], "-rgb")){
+      outputMode = OUTPUT_RGB;
+      streamName = argv[++n];
+    }
+  }
+
+  /* frames are written by all ranks (only the root holds a whole frame when gathering),
+     set up first so messages are moved off stdout before any are printed when streaming to stdout */
+  output_t *output = outputSetup(MPI_COMM_WORLD, outputMode, WIDTH, HEIGHT, streamName, ring);
   
   double tic,toc,elapsed;
   elapsed=0;
   
-  // initialize triangles and spheres
-  scene_t *scene = sceneSetup();
+  // initialize triangles and spheres, the static grid lists and distance field
+  // (mapped from the -cache file when it was built from the same inputs)
+  sceneOptions_t options = sceneParseOptions(argc, argv);
+  sdf_t   *sdf   = NULL;
+  scene_t *scene = sceneCacheSetup(MPI_COMM_WORLD, &options, &sdf);
 
   grid_t     *grid      = scene->grid;
   shape_t    *shapes    = scene->shapes;
   material_t *materials = scene->materials;
   light_t    *lights    = scene->lights;
-  
-  /* Will contain the raw image */
-  unsigned char *img = (unsigned char*) calloc(3*WIDTH*HEIGHT, sizeof(char));
-  unsigned char *all_ranks = (unsigned char*) calloc(3*WIDTH*HEIGHT, sizeof(char));
-
-  // 1. location of observer eye (before rotation)
-  sensor_t sensor;
-
-  // background color
-  sensor.bg.red   = 126./256;
-  sensor.bg.green = 192./256;
-  sensor.bg.blue  = 238./256;
-
-  dfloat br = 3.75;
-
-  // angle elevation to y-z plane
-  dfloat eyeAngle = M_PI/4.f; // 0 is above, pi/2 is from side.  M_PI/3; 0; M_PI/2.;
-
-  // target view
-  vector_t targetX = vectorCreate(BOXSIZE/2, HEIGHT, BOXSIZE); // this I do not understand why target -B/2
-  sensor.eyeX = vectorAdd(targetX, vectorCreate(0, -br*HEIGHT*cos(eyeAngle), -br*BOXSIZE*sin(eyeAngle))); 
-  dfloat sensorAngle = eyeAngle +5.*M_PI/180.;
-  sensor.Idir   = vectorCreate(1.f, 0.f, 0.f);
-  sensor.Jdir   = vectorCreate(0.f, sin(sensorAngle), -cos(sensorAngle));
-  vector_t sensorNormal = vectorCrossProduct(sensor.Idir, sensor.Jdir);
-  
-  // 2.4 length of sensor in axis 1 & 2
-  sensor.Ilength = 25.0f;
-  sensor.Jlength = HEIGHT*(25.0f)/WIDTH;
-  sensor.offset  = 0.f;
 
-  // 2.5 normal distance from sensor to focal plane
-  dfloat lensOffset = 50;
-  sensor.lensC = vectorAdd(sensor.eyeX, vectorScale(lensOffset, vectorCrossProduct(sensor.Idir, sensor.Jdir)));
+  // dynamic state of the spheres, split into slabs across ranks
+  bodies_t   *bodies    = bodiesSetup(scene->Nshapes, shapes);
+  domain_t   *domain    = domainSetup(MPI_COMM_WORLD, grid, bodies);
 
-  // why 0.25 ?
-  sensor.focalPlaneOffset = 0.22f*fabs(vectorTripleProduct(sensor.Idir, sensor.Jdir, vectorSub(targetX,sensor.eyeX))); // triple product
-  
-  //  sensor.focalOffset = 0.8*BOXSIZE - sensor.lensC.z; // needs to be distance to plane from sensor
+  // physics only needs the distance to the static shapes (computed once) and the spheres in their own cell list
+  broadphase_t *awake      = broadphaseSetup(bodies, 0);
+  broadphase_t *sleeping   = broadphaseSetup(bodies, 1);
+  solver_t     *solver     = solverSetup(bodies);
 
-  printf("lensOffset = %g, sensor.focalPlaneOffset = %g\n", lensOffset, sensor.focalPlaneOffset);
+  // continue from the sphere state saved before frameStart
+  int frameStart = 0;
+  if(restartName){
+    frameStart = checkpointLoad(MPI_COMM_WORLD, restartName, scene->hash, bodies, domain, solver);
+    if(rank==0)
+      printf("restarting at frame %d from %s\n", frameStart, restartName);
+  }
   
-  dfloat *randomNumbers = (dfloat*) calloc(2*NRANDOM, sizeof(dfloat));
-  for(int i=0;i<NRANDOM;++i){
-    dfloat r1 = 2*drand48()-1;
-    dfloat r2 = 2*drand48()-1;
+  /* image rows rendered by each rank, rank r renders rows [rowStarts[r], rowStarts[r+1]) */
+  int *rowStarts  = (int*) calloc(size+1, sizeof(int));
 
-    randomNumbers[2*i+0] = r1/sqrt(r1*r1+r2*r2);
-    randomNumbers[2*i+1] = r2/sqrt(r1*r1+r2*r2);
-  }
+  /* time taken to render each image row in the last frame */
+  dfloat *rowCost = (dfloat*) calloc(HEIGHT, sizeof(dfloat));
+
+  /* Will contain the raw image rows of this rank */
+  unsigned char *img = NULL;
+
+  // camera of the scene
+  sensor_t sensor = scene->sensor;
+
+  // directions for the lens samples
+  dfloat *randomNumbers = sensorRandomNumbers();
   
   // number of angles to render at
   int Ntheta = 10;
+  int frameEnd = (endFrame>=0 && endFrame<Ntheta) ? endFrame : Ntheta;
   
   // loop over scene angles
-  for(int thetaId=0;thetaId<Ntheta;++thetaId){
+  for(int thetaId=frameStart;thetaId<frameEnd;++thetaId){
     
     /* rotation angle in y-z */
     dfloat theta = thetaId*M_PI*2./(dfloat)(Ntheta-1);
 
-    /* sort objects into grid */
-    gridPopulate(grid, scene->Nshapes, shapes);
+    /* collect sphere positions from all ranks into the render copy */
+    domainGather(domain, bodies, shapes);
+
+    /* save sphere state (not the frame restarted from) */
+    if(checkpointEvery>0 && thetaId%checkpointEvery==0 && thetaId!=frameStart){
+      char checkpointName[BUFSIZ];
+      mkdir("checkpoints", S_IRUSR | S_IREAD | S_IWUSR | S_IWRITE | S_IXUSR | S_IEXEC);
+      sprintf(checkpointName, "checkpoints/checkpoint_%05d.bin", thetaId);
+      checkpointSave(MPI_COMM_WORLD, checkpointName, thetaId, scene->hash, bodies, domain, solver);
+    }
+
+    /* update grid cells of spheres that left their fattened bounds */
+    int Nreinserted = gridUpdateSpheres(grid, bodies, shapes);
+
+    /* split rows into equal cost ranges using the cost of each row in the
+       previous frame (consecutive frames differ only slightly) */
+    balancePartition(HEIGHT, rowCost, size, rowStarts);
+    dfloat predicted = balancePredictImbalance(HEIGHT, rowCost, size, rowStarts);
+
+    int rowStart = rowStarts[rank];
+    int rowEnd   = rowStarts[rank+1];
+
+    for(int row=0;row<HEIGHT;++row)
+      rowCost[row] = 0;
+
+    /* save scene as ppm file */
+    char fileName[BUFSIZ];
+
+    // make sure images directory exists (streams are not written there)
+    if(outputMode==OUTPUT_MPIIO || outputMode==OUTPUT_GATHER || outputMode==OUTPUT_QOI)
+      mkdir("images", S_IRUSR | S_IREAD | S_IWUSR | S_IWRITE | S_IXUSR | S_IEXEC);
+    
+    // rows are written as they are rendered
+    sprintf(fileName, "images/image_%05d.%s", thetaId, (outputMode==OUTPUT_QOI) ? "qoi" : "ppm");
+    outputFrameBegin(output, fileName, rowStart, rowEnd);
+
+    // rows of this rank (only a ring of them with -ring)
+    img = (unsigned char*) realloc(img, 3*WIDTH*outputBufferRows(output)*sizeof(char));
+
+    capture_t *capture = (captureName && thetaId==frameStart) ? captureSetup(captureEvery) : NULL;
 
     /* start timer */
     if (rank == size/2)
@@ -99,58 +215,67 @@ int main(int argc, char *argv[]){
     /* render scene */
     renderKernel(WIDTH,
 		 HEIGHT,
+		 rowStart,
+		 rowEnd,
 		 scene[0],
 		 sensor,
 		 cos(theta), 
 		 sin(theta),
 		 randomNumbers,
-		 img);
+		 img,
+		 rowCost,
+		 output,
+		 capture);
+
+    /* write any rows not yet written */
+    outputFrameEnd(output, img);
+
+    if(capture){
+      captureSave(MPI_COMM_WORLD, captureName, thetaId, scene->hash, bodies, domain, capture);
+      captureFree(capture);
+    }
+
+    /* every rank needs the whole cost profile to partition the next frame */
+    MPI_Allreduce(MPI_IN_PLACE, rowCost, HEIGHT, MPI_DFLOAT, MPI_SUM, MPI_COMM_WORLD);
+
+    if(rank==0 && thetaId>0)
+      printf("frame %d: predicted render imbalance %g, achieved %g\n",
+	     thetaId, predicted, balancePredictImbalance(HEIGHT, rowCost, size, rowStarts));
 
-    int chunk=HEIGHT*WIDTH*3/size;
-    
-    MPI_Gather(img+rank*chunk,chunk,MPI_UNSIGNED_CHAR,all_ranks,chunk,MPI_UNSIGNED_CHAR,0,MPI_COMM_WORLD);
-    
     /* report elapsed time */
     if (rank == size/2) 
       toc = MPI_Wtime();
     
-    dfloat dt = .025, g = 1;
-    int NsubSteps= 40;
+    dfloat g = 1;
 
     if (rank == size/2)
       ticTimer();
     
-    // collide and move spheres in time and update grid
-    for(int subStep=0;subStep<NsubSteps;++subStep){
-      
-      sphereCollisions(grid, dt, g, scene->Nshapes, shapes);
+    // collide and move spheres in time with adaptive substeps (render grid is updated once per frame)
+    int Nasleep;
+    int NsubSteps = sphereFrame(sdf, awake, sleeping, solver, domain, g, bodies, &Nasleep);
 
-      sphereUpdates(grid, dt, g, scene->Nshapes, shapes);
+    MPI_Allreduce(MPI_IN_PLACE, &Nasleep, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
 
-      gridPopulate(grid, scene->Nshapes, shapes);
-    }
+    if(rank==0)
+      printf("frame %d: %d physics substeps, %d of %d spheres asleep, %d re-inserted in grid\n",
+	     thetaId, NsubSteps, Nasleep, bodies->Nbodies, Nreinserted);
 
     // report time taken to move and collide spheres
     if (rank == size/2)
       tocTimer("move and collide Spheres");
 
-    /* save scene as ppm file */
-    char fileName[BUFSIZ];
-
-    // make sure images directory exists
-    mkdir("images", S_IRUSR | S_IREAD | S_IWUSR | S_IWRITE | S_IXUSR | S_IEXEC);
-    
-    // write image as ppm format file
-    if (rank == size/2) {
+    if (rank == size/2)
       elapsed += toc-tic;
-      sprintf(fileName, "images/image_%05d.ppm", thetaId);
-      saveppm(fileName, all_ranks, WIDTH, HEIGHT);
-    }
   }
   if (rank == size/2) 
     printf("elapsed time was %lf seconds\n",elapsed);
   
+  outputFree(output);
+
   free(img);
+  free(rowStarts);
+  free(rowCost);
 
   MPI_Finalize();
   
@@ -0,0 +1,133 @@
+#include "simpleRayTracer.h"
+
+// contact constraint solver for the sphere collisions
+// Notes:
+//
+// a. every owned body keeps its contacts (up to p_maxNcontacts, found by
+//    sphereCollisions) with the impulse accumulated along the contact normal
+// b. contacts persist from one substep to the next, a contact found again
+//    starts from its last impulse (warm start)
+// c. Jacobi iterations: all contacts are updated from the same velocities, so
+//    owned bodies are independent, then halo velocities are refreshed
+// d. both spheres of a pair solve the same contact from their own side with the
+//    same data, so the impulses are equal and opposite without any atomics
+// e. spheres have unit mass as in the original collision model
+// f. the cache lives with the owner, a body moving to another rank starts
+//    its next substep cold
+
+solver_t *solverSetup(const bodies_t *bodies){
+
+  solver_t *solver = (solver_t*) calloc(1, sizeof(solver_t));
+
+  solver->Ncontacts = (int*) calloc(bodies->Nbodies, sizeof(int));
+  solver->contacts  = (contact_t*) calloc((size_t)bodies->Nbodies*p_maxNcontacts, sizeof(contact_t));
+
+  return solver;
+}
+
+// contacts of a body (those of the last substep until sphereCollisions replaces them)
+contact_t *solverContacts(const solver_t *solver, const int body){
+
+  return solver->contacts + (size_t)body*p_maxNcontacts;
+}
+
+// impulse cached for contact with other (-1 for static shapes), zero if new
+dfloat solverCachedImpulse(const int Ncached, const contact_t *cached, const int other){
+
+  for(int m=0;m<Ncached;++m)
+    if(cached[m].other==other)
+      return cached[m].impulse;
+
+  return 0;
+}
+
+// normal velocity a contact should end with: bounce when approaching fast, come
+// to rest when slow, and push apart overlapping spheres
+dfloat solverContactTarget(const dfloat vn, const dfloat overlap, const dfloat radius,
+			   const dfloat restitution, const dfloat dt){
+
+  dfloat target = 0;
+
+  if(vn < -p_restRate*radius)
+    target = -restitution*vn;
+
+  const dfloat push = p_contactBias*max(overlap - p_contactSlop*radius, 0)/dt;
+
+  return max(target, push);
+}
+
+// Jacobi iterations on the contacts of the owned bodies, the body post-collision
+// velocity holds the warm started velocity on entry and the solution on exit
+void solverSolve(solver_t *solver, domain_t *domain, bodies_t *bodies){
+
+  const int Nowned = domain->Nowned;
+  const int *owned = domain->owned;
+
+  dfloat *dvx = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *dvy = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *dvz = (dfloat*) calloc(Nowned, sizeof(dfloat));
+
+  dfloat *nvx = bodies->nvx;
+  dfloat *nvy = bodies->nvy;
+  dfloat *nvz = bodies->nvz;
+
+  // halo bodies need their warm started velocities
+  domainHaloRefresh(domain, bodies);
+
+  for(int it=0;it<p_solverIterations;++it){
+
+#pragma omp parallel for schedule(dynamic, 4)
+    for(int n=0;n<Nowned;++n){
+      const int b = owned[n];
+      vector_t dv = vectorCreate(0,0,0);
+
+      if(!bodies->asleep[b]){
+	contact_t *contacts = solverContacts(solver, b);
+
+	for(int c=0;c<solver->Ncontacts[b];++c){
+	  contact_t &contact = contacts[c];
+
+	  // relative normal velocity (static shapes do not move)
+	  vector_t v = vectorCreate(nvx[b], nvy[b], nvz[b]);
+	  if(contact.other!=-1)
+	    v = vectorSub(v, vectorCreate(nvx[contact.other], nvy[contact.other], nvz[contact.other]));
+
+	  const dfloat vn = vectorDot(v, contact.normal);
+
+	  // accumulated impulse can only push
+	  dfloat impulse = contact.impulse + p_jacobiRelaxation*contact.mass*(contact.target - vn);
+	  impulse = max(impulse, 0);
+
+	  dv = vectorAdd(dv, vectorScale(impulse - contact.impulse, contact.normal));
+	  contact.impulse = impulse;
+	}
+      }
+
+      dvx[n] = dv.x;
+      dvy[n] = dv.y;
+      dvz[n] = dv.z;
+    }
+
+    // owned bodies are distinct so the scattered updates do not collide
+#pragma omp parallel for simd
+    for(int n=0;n<Nowned;++n){
+      const int b = owned[n];
+      nvx[b] += dvx[n];
+      nvy[b] += dvy[n];
+      nvz[b] += dvz[n];
+    }
+
+    domainHaloRefresh(domain, bodies);
+  }
+
+  free(dvx);
+  free(dvy);
+  free(dvz);
+}
+
+void solverFree(solver_t *solver){
+
+  free(solver->Ncontacts);
+  free(solver->contacts);
+  free(solver);
+}
@@ -1,180 +1,747 @@
 #include "simpleRayTracer.h"
 
-void sphereCollisions(const grid_t *grid,
+// wake the sleeping bodies touched by the Nsources bodies in sources, the
+// bodies woken are appended to woken[Nwoken..], returns the new Nwoken (a body
+// is only appended by the thread that clears its flag, so it is listed once)
+static int sphereWakePass(const broadphase_t *sleeping,
+			  const int Nsources, const int *sources,
+			  bodies_t *bodies, int Nwoken, int *woken){
+
+  if(sleeping->Nlocal==0) return Nwoken;
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for(int n=0;n<Nsources;++n){
+    const int b = sources[n];
+    const dfloat x = bodies->x[b], y = bodies->y[b], z = bodies->z[b];
+
+    const int ci = broadphaseCell(sleeping, x);
+    const int cj = broadphaseCell(sleeping, y);
+    const int ck = broadphaseCell(sleeping, z);
+
+    for(int k=ck-1;k<=ck+1;++k){
+      for(int j=cj-1;j<=cj+1;++j){
+	for(int i=ci-1;i<=ci+1;++i){
+
+	  const int bucket = broadphaseBucket(sleeping, i, j, k);
+
+	  int hits[p_maxNcontacts];
+	  const int Nhits = broadphaseOverlaps(sleeping, bucket, x, y, z, bodies->radius[b], p_maxNcontacts, hits);
+
+	  for(int h=0;h<Nhits;++h){
+	    const int other = hits[h];
+	    int wasAsleep;
+#pragma omp atomic capture
+	    { wasAsleep = bodies->asleep[other]; bodies->asleep[other] = 0; }
+
+	    if(wasAsleep){
+	      bodies->slowSteps[other] = 0;
+	      int slot;
+#pragma omp atomic capture
+	      slot = Nwoken++;
+	      woken[slot] = other;
+	    }
+	  }
+	}
+      }
+    }
+  }
+
+  return Nwoken;
+}
+
+// wake sleeping bodies touched by awake bodies (owned or halo), collective
+// Notes:
+//
+// a. bodies woken in a pass wake the sleepers they touch in the next pass,
+//    until a pass wakes no body, so no contact is solved against a neighbour
+//    that stays frozen
+// b. every rank holding both bodies of a contact makes the same decision, a
+//    chain that crosses a slab edge is continued by the neighbour once the
+//    owners have sent it their woken bodies (halo refresh), passes and refreshes
+//    repeat until no rank wakes a body
+void sphereWake(domain_t *domain,
+		const broadphase_t *awake,
+		const broadphase_t *sleeping,
+		bodies_t *bodies){
+
+  // bodies woken this round after the sources of the round, all of them are
+  // sleeping broadphase members so the list holds at most Nlocal
+  int *woken = (int*) malloc(max(sleeping->Nlocal, 1)*sizeof(int));
+
+  // first round starts from the bodies awake at the start of the substep
+  int Nsources = 0;
+  int Nwoken = sphereWakePass(sleeping, awake->Nlocal, awake->localIds, bodies, Nsources, woken);
+
+  while(1){
+
+    // bodies woken by the last pass are the sources of the next
+    for(int start=Nsources;start<Nwoken;){
+      const int end = Nwoken;
+      Nwoken = sphereWakePass(sleeping, end-start, woken+start, bodies, Nwoken, woken);
+      start = end;
+    }
+
+    int Nnew = Nwoken-Nsources;
+    MPI_Allreduce(MPI_IN_PLACE, &Nnew, 1, MPI_INT, MPI_SUM, domain->comm);
+    if(Nnew==0) break;
+
+    domainHaloRefresh(domain, bodies);
+
+    // next round starts from every body woken so far, here or by its owner
+    Nsources = 0;
+    for(int n=0;n<sleeping->Nlocal;++n){
+      const int b = sleeping->localIds[n];
+      if(!bodies->asleep[b])
+	woken[Nsources++] = b;
+    }
+
+    Nwoken = sphereWakePass(sleeping, Nsources, woken, bodies, Nsources, woken);
+  }
+
+  free(woken);
+}
+
+// unit direction away from a static surface: the distance field gradient
+// vanishes where the unsigned distance has a kink (across thin surfaces such as
+// the bunny shell, disks and rectangles), there push against the velocity, or
+// against gravity for a body at rest
+static vector_t sphereStaticNormal(const vector_t normal, const vector_t velocity, const dfloat g){
+
+  if(vectorNorm(normal)>0.5)
+    return normal;
+
+  if(vectorNorm(velocity)>p_eps)
+    return vectorNormalize(vectorScale(-1, velocity));
+
+  return vectorCreate(0, (g>=0) ? -1 : 1, 0);
+}
+
+// shallowest overlap among the p_maxNcontacts-1 deepest of N candidates (the last
+// contact slot is kept for the static shapes), 0 if they all fit
+static dfloat sphereContactCutoff(const int N, const dfloat *overlaps){
+
+  const int cap = p_maxNcontacts-1;
+  if(N<=cap) return 0;
+
+  // partial selection sort of the deepest
+  dfloat deepest[2*p_maxNcontacts];
+  memcpy(deepest, overlaps, N*sizeof(dfloat));
+  for(int i=0;i<cap;++i)
+    for(int j=i+1;j<N;++j)
+      if(deepest[j]>deepest[i]){
+	const dfloat tmp = deepest[i];
+	deepest[i] = deepest[j];
+	deepest[j] = tmp;
+      }
+
+  return deepest[cap-1];
+}
+
+// find the contacts of the owned bodies and solve them for the post-collision velocities
+// Notes:
+//
+// a. sphere-sphere contacts come from the broadphases (owned and halo bodies),
+//    sphere-world contacts from the distance field of the static shapes
+// b. contacts found again this substep are warm started from their cached impulse
+// c. gravity is projected out of the force of bodies touching a static surface
+// d. the last contact slot is kept for the static shapes, a crowded body keeps
+//    its deepest sphere contacts and a pair is only kept if it is deep enough
+//    for both bodies (their cutoffs are exchanged with the halo), so the two
+//    sides of a pair agree except on exactly equal overlaps
+void sphereCollisions(const sdf_t *sdf,
+		      const broadphase_t *awake,
+		      const broadphase_t *sleeping,
+		      solver_t *solver,
+		      domain_t *domain,
 		      const dfloat dt,
 		      const dfloat g,
-		      const int Nshapes,
-		      shape_t *shapes){
-
-  // loop over all shapes
-  for(int id=0;id<Nshapes;++id){
-    shape_t &shape = shapes[id];
-
-    // only do something if shape is a sphere
-    if(shape.type==SPHERE){
-      
-      // sum up all sphere-sphere interactions
-      // do hard reflections for collision with nearest non-sphere
-      shape.sphere.newVelocity = shape.sphere.velocity;
-
-      // find range of cells that overlap with sphere
-      const  int imin = shape.bbox.imin;
-      const  int imax = shape.bbox.imax;
-      const  int jmin = shape.bbox.jmin;
-      const  int jmax = shape.bbox.jmax;
-      const  int kmin = shape.bbox.kmin;
-      const  int kmax = shape.bbox.kmax;
-	
-      int NcollisionSpheres = 0;
-      int collisionSphereIds[p_maxNcollisions];
-	
-      int collisionShapeId = -1;
+		      bodies_t *bodies){
+
+  const int Nowned = domain->Nowned;
+  const int maxNcandidates = 2*p_maxNcontacts;
+
+  // overlapping spheres of the owned bodies
+  int    *Ncandidates = (int*) calloc(Nowned, sizeof(int));
+  int    *candidates  = (int*) calloc((size_t)Nowned*maxNcandidates, sizeof(int));
+  dfloat *overlaps    = (dfloat*) calloc((size_t)Nowned*maxNcandidates, sizeof(dfloat));
+
+  // 1. candidate sphere contacts and the cutoff of each owned body
+#pragma omp parallel for schedule(dynamic, 4)
+  for(int n=0;n<Nowned;++n){
+    const int body = domain->owned[n];
+
+    bodies->contactCutoff[body] = 0;
+
+    if(!bodies->asleep[body]){
+
+      const vector_t pos = vectorCreate(bodies->x[body], bodies->y[body], bodies->z[body]);
+      const dfloat radius = bodies->radius[body];
+
+      int    *others = candidates + (size_t)n*maxNcandidates;
+      dfloat *depths = overlaps   + (size_t)n*maxNcandidates;
+      int N = 0;
       int m;
-      dfloat mindist = 1e9;
-
-      // loop over cells that overlap with sphere
-      for(int k=kmin;k<=kmax;++k){
-	for(int j=jmin;j<=jmax;++j){
-	  for(int i=imin;i<=imax;++i){
-	      
-	    const int cellID = i + grid->NI*j + grid->NI*grid->NJ*k;
-	    const int start = grid->boxStarts[cellID];
-	    const int   end = grid->boxStarts[cellID+1];
-
-	    // check for collision with objects that are contained in this cell
-	    for(int offset=start;offset<end;++offset){
-	      const int otherShapeId = grid->boxContents[offset];
-	      const shape_t otherShape = shapes[otherShapeId];
-
-	      // do not collide sphere with self
-	      if(shape.id != otherShapeId){
-
-		// if other shape is sphere do Newtonian collision with old velocity
-		if(otherShape.type == SPHERE && NcollisionSpheres<p_maxNcollisions){
-		  
-		  vector_t dX = vectorSub(otherShape.sphere.pos, shape.sphere.pos);
-		  dfloat dist = vectorNorm(dX);
-		    
-		  if(dist< shape.sphere.radius+otherShape.sphere.radius){
-		      
-		    // use rough sphere colliding model
-		    dfloat vdotdX1 = vectorDot(     shape.sphere.velocity,dX)/(dist*dist + p_eps);
-		    dfloat vdotdX2 = vectorDot(otherShape.sphere.velocity,dX)/(dist*dist + p_eps);
-		      
-		    // spheres not diverging to avoid capture
-		    if(!(vdotdX1<0 && vdotdX2>0)){
-			
-		      // check that this collision did not already get recorded
-		      for(m=0;m<NcollisionSpheres;++m)
-			if(collisionSphereIds[m] == otherShapeId)
-			  break;
-			
-		      if(m==NcollisionSpheres)
-			collisionSphereIds[NcollisionSpheres++] = otherShapeId;
-		    }
-		  }
-		}
-		else if(otherShape.type != SPHERE){
-		  // if other shape is not  a sphere then
-		  // check if this is the nearest other object to sphere
-		  vector_t closest;
-		  dfloat dist = projectPointShape(shape.sphere.pos, otherShape, &closest);
-		    
-		  if(dist<shape.sphere.radius && dist<mindist){ // find maximum penetration
-		    collisionShapeId = otherShapeId;
-		    mindist = dist;
-		  }
-		}
+
+      // find sphere-sphere contacts in the awake and sleeping broadphase cells around the body
+      const broadphase_t *broadphases[2] = {awake, sleeping};
+      for(int p=0;p<2;++p){
+	const broadphase_t *broadphase = broadphases[p];
+
+	const int ci = broadphaseCell(broadphase, pos.x);
+	const int cj = broadphaseCell(broadphase, pos.y);
+	const int ck = broadphaseCell(broadphase, pos.z);
+
+	for(int k=ck-1;k<=ck+1;++k){
+	  for(int j=cj-1;j<=cj+1;++j){
+	    for(int i=ci-1;i<=ci+1;++i){
+
+	      const int bucket = broadphaseBucket(broadphase, i, j, k);
+
+	      // overlapping bodies (including this one) from the vectorised distance test
+	      int hits[2*p_maxNcontacts+1];
+	      const int Nhits = broadphaseOverlaps(broadphase, bucket, pos.x, pos.y, pos.z, radius, maxNcandidates+1, hits);
+
+	      for(int h=0;h<Nhits && N<maxNcandidates;++h){
+		const int other = hits[h];
+
+		// do not collide body with self
+		if(body == other) continue;
+
+		vector_t dX = vectorCreate(pos.x-bodies->x[other], pos.y-bodies->y[other], pos.z-bodies->z[other]);
+		dfloat dist = vectorNorm(dX);
+		dfloat R = radius + bodies->radius[other];
+
+		if(dist>=R || dist<p_eps) continue;
+
+		// check that this contact did not already get recorded (buckets can repeat)
+		for(m=0;m<N;++m)
+		  if(others[m] == other)
+		    break;
+		if(m<N) continue;
+
+		// both bodies of the pair compute the same overlap
+		others[N] = other;
+		depths[N] = R-dist;
+		++N;
 	      }
 	    }
 	  }
 	}
       }
-	
-      // collide with nearest spheres
-      for(m=0;m<NcollisionSpheres;++m){
-	const int collisionSphereId = collisionSphereIds[m];
-	const shape_t otherShape = shapes[collisionSphereId];
-	vector_t dX = vectorSub(otherShape.sphere.pos, shape.sphere.pos);
-	  
+
+      Ncandidates[n] = N;
+      bodies->contactCutoff[body] = sphereContactCutoff(N, depths);
+    }
+  }
+
+  // cutoffs of the halo bodies
+  domainHaloRefresh(domain, bodies);
+
+  // 2. contacts kept by both bodies of a pair, the static contact and the warm start
+  // (each body only writes its own contacts, post-collision velocity and force so bodies are independent,
+  //  dynamic schedule because bodies touching meshes have many more neighbours)
+#pragma omp parallel for schedule(dynamic, 4)
+  for(int n=0;n<Nowned;++n){
+    const int body = domain->owned[n];
+
+    // only do something if body is awake
+    if(!bodies->asleep[body]){
+
+      const vector_t pos = vectorCreate(bodies->x[body], bodies->y[body], bodies->z[body]);
+      const vector_t velocity = vectorCreate(bodies->vx[body], bodies->vy[body], bodies->vz[body]);
+      const dfloat radius = bodies->radius[body];
+
+      contact_t *contacts = solverContacts(solver, body);
+
+      // contacts of the last substep
+      const int Ncached = solver->Ncontacts[body];
+      contact_t cached[p_maxNcontacts];
+      memcpy(cached, contacts, Ncached*sizeof(contact_t));
+
+      const int    *others = candidates + (size_t)n*maxNcandidates;
+      const dfloat *depths = overlaps   + (size_t)n*maxNcandidates;
+
+      int Ncontacts = 0;
+
+      for(int c=0;c<Ncandidates[n] && Ncontacts<p_maxNcontacts-1;++c){
+	const int other = others[c];
+
+	if(depths[c]<bodies->contactCutoff[body] || depths[c]<bodies->contactCutoff[other]) continue;
+
+	vector_t dX = vectorCreate(pos.x-bodies->x[other], pos.y-bodies->y[other], pos.z-bodies->z[other]);
 	dfloat dist = vectorNorm(dX);
-	  
-	// use rough sphere colliding model
-	dfloat vdotdX1 = vectorDot(     shape.sphere.velocity,dX)/(dist*dist + p_eps);
-	dfloat vdotdX2 = vectorDot(otherShape.sphere.velocity,dX)/(dist*dist + p_eps);
-	  
-	// spheres not diverging to avoid capture
-	if(!(vdotdX1<0 && vdotdX2>0)){
-	  
-	  dfloat dVdotdX = vdotdX2-vdotdX1;
-	  dfloat bounceFactor = 1;
-	    
-	  shape.sphere.newVelocity =
-	    vectorAdd(shape.sphere.newVelocity, vectorScale(bounceFactor*dVdotdX, dX));
-	    
-	}
+	dfloat R = radius + bodies->radius[other];
+
+	// both bodies of the pair compute the same contact from their side
+	contact_t &contact = contacts[Ncontacts++];
+	contact.other  = other;
+	contact.normal = vectorScale(1./dist, dX);
+	contact.mass   = 0.5;
+
+	const vector_t dV = vectorCreate(velocity.x-bodies->vx[other], velocity.y-bodies->vy[other], velocity.z-bodies->vz[other]);
+	const dfloat vn = vectorDot(dV, contact.normal);
+	contact.target = solverContactTarget(vn, R-dist, 0.5*R, p_sphereRestitution, dt);
       }
 
       vector_t gforce = vectorCreate(0,g,0);
 
-      // perform collision with nearest non-sphere if any
-      if(collisionShapeId!=-1){
-	const shape_t otherShape = shapes[collisionShapeId];
-	
-	// bounce back 
-	vector_t closest;
-	dfloat dist = projectPointShape(shape.sphere.pos, otherShape, &closest);
-	  
-	if(dist<shape.sphere.radius){
-	  vector_t disp = vectorSub(shape.sphere.pos, closest);
-	  dfloat vdotdisp = vectorDot(shape.sphere.velocity, disp);
-	    
-	  vector_t n = shapeComputeNormal(closest, otherShape);
-	    
-	  if(vdotdisp<0){
-	      
-	    dfloat vdotn = vectorDot(shape.sphere.velocity, n);
-	    dfloat bounceFactor = 1.8; // sticky at 1, bounce at 2
-	      
-	    shape.sphere.newVelocity =
-	      vectorAdd(shape.sphere.newVelocity, vectorScale(-bounceFactor*vdotn, n));
+      // distance and direction to the nearest static surface
+      vector_t staticNormal;
+      const dfloat staticDist = sdfDistance(sdf, pos, &staticNormal);
+
+      if(staticDist<radius){
+	staticNormal = sphereStaticNormal(staticNormal, velocity, g);
+
+	// normal points from the surface to the body centre
+	contact_t &contact = contacts[Ncontacts++];
+	contact.other  = -1;
+	contact.normal = staticNormal;
+	contact.mass   = 1;
+
+	const dfloat vn = vectorDot(velocity, staticNormal);
+	contact.target = solverContactTarget(vn, radius-staticDist, radius, p_staticRestitution, dt);
+
+	// project out gravity when in collision state
+	gforce = vectorSub(gforce, vectorScale(vectorDot(staticNormal, gforce), staticNormal));
+      }
+
+      bodies->fx[body] = gforce.x;
+      bodies->fy[body] = gforce.y;
+      bodies->fz[body] = gforce.z;
+
+      // warm start from the impulses of the last substep
+      vector_t newVelocity = velocity;
+      for(int c=0;c<Ncontacts;++c){
+	contacts[c].impulse = solverCachedImpulse(Ncached, cached, contacts[c].other);
+	newVelocity = vectorAdd(newVelocity, vectorScale(contacts[c].impulse, contacts[c].normal));
+      }
+
+      bodies->nvx[body] = newVelocity.x;
+      bodies->nvy[body] = newVelocity.y;
+      bodies->nvz[body] = newVelocity.z;
+
+      solver->Ncontacts[body] = Ncontacts;
+    }
+  }
+
+  free(Ncandidates);
+  free(candidates);
+  free(overlaps);
+
+  solverSolve(solver, domain, bodies);
+}
+
+// largest substep (up to dtMax, no shorter than p_frameTime/p_maxNsubSteps) in
+// which no body moves more than p_cfl of its radius, using the velocity at the
+// start of the substep and gravity as a bound on the force (collective over
+// ranks, called before the contacts are solved so that their targets use this
+// substep, sphereSpeedLimit then keeps the bound)
+dfloat sphereTimeStep(const domain_t *domain,
+		      const dfloat dtMax,
+		      const dfloat g,
+		      const bodies_t *bodies){
+
+  const int *owned = domain->owned;
+  const dfloat *vx = bodies->vx, *vy = bodies->vy, *vz = bodies->vz;
+  const dfloat f = fabs(g);
+
+  dfloat dt = dtMax;
+
+#pragma omp parallel for simd reduction(min:dt)
+  for(int n=0;n<domain->Nowned;++n){
+    const int b = owned[n];
+
+    // solve |v|*dt + |f|*dt^2/2 = cfl*r for dt
+    const dfloat v = sqrt(vx[b]*vx[b] + vy[b]*vy[b] + vz[b]*vz[b]);
+    const dfloat d = p_cfl*bodies->radius[b];
+
+    const dfloat dtBody =
+      (f>p_eps) ? 2*d/(v + sqrt(v*v + 2*f*d)) :
+      (v>p_eps) ? d/v : dtMax;
+
+    // sleeping bodies do not move
+    if(!bodies->asleep[b])
+      dt = min(dt, dtBody);
+  }
+
+  MPI_Allreduce(MPI_IN_PLACE, &dt, 1, MPI_DFLOAT, MPI_MIN, domain->comm);
+
+  return max(dt, min(dtMax, p_frameTime/p_maxNsubSteps));
+}
+
+// slow down the awake owned bodies whose post-collision velocity would move them
+// more than p_cfl radii in dt (contacts can speed bodies up and the substep has
+// a floor), the halo and broadphase cells are sized on that bound (collective
+// over ranks)
+static void sphereSpeedLimit(domain_t *domain, const dfloat dt, const dfloat g, bodies_t *bodies){
+
+  const int *owned = domain->owned;
+  dfloat *nvx = bodies->nvx, *nvy = bodies->nvy, *nvz = bodies->nvz;
+
+  int Nlimited = 0;
+
+#pragma omp parallel for reduction(+:Nlimited)
+  for(int n=0;n<domain->Nowned;++n){
+    const int b = owned[n];
+
+    // largest speed with |v|*dt + |g|*dt^2/2 <= cfl*r
+    const dfloat vmax = max(p_cfl*bodies->radius[b] - 0.5*fabs(g)*dt*dt, 0)/dt;
+    const dfloat v = sqrt(nvx[b]*nvx[b] + nvy[b]*nvy[b] + nvz[b]*nvz[b]);
+
+    if(!bodies->asleep[b] && v>vmax){
+      const dfloat scale = vmax/v;
+      nvx[b] *= scale; nvy[b] *= scale; nvz[b] *= scale;
+      ++Nlimited;
+    }
+  }
+
+  MPI_Allreduce(MPI_IN_PLACE, &Nlimited, 1, MPI_INT, MPI_SUM, domain->comm);
+
+  // pair impacts use the halo post-collision velocities
+  if(Nlimited)
+    domainHaloRefresh(domain, bodies);
+}
+
+// earliest time a sphere moving from p with velocity v and force f touches the
+// static shapes within T (conservative advancement, returns T if it does not)
+// Notes:
+//
+// a. the trilinear distance can exceed the true distance by up to half a cell
+//    diagonal, so the steps only cover the clearance beyond that (and at least
+//    the tolerance)
+static dfloat sphereAdvance(const sdf_t *sdf,
+			    const vector_t p,
+			    const vector_t v,
+			    const vector_t f,
+			    const dfloat radius,
+			    const dfloat T,
+			    vector_t *normal){
+
+  // bound on the speed of the sphere over the interval
+  const dfloat speed = vectorNorm(v) + vectorNorm(f)*T;
+  if(speed<p_eps) return T;
+
+  // bound on the interpolation error of the distance
+  const dfloat slack = 0.5*sqrt(sdf->dx*sdf->dx + sdf->dy*sdf->dy + sdf->dz*sdf->dz);
+
+  dfloat s = 0;
+  for(int it=0;it<p_ccdMaxIterations;++it){
+    const vector_t q = vectorAdd(p, vectorAdd(vectorScale(s, v), vectorScale(0.5*s*s, f)));
+    const dfloat clearance = sdfDistance(sdf, q, normal) - radius;
+
+    if(clearance<p_ccdTolerance*radius)
+      return s;
+
+    // the sphere can not reach the surface sooner than this
+    s += max(clearance-slack, p_ccdTolerance*radius)/speed;
+    if(s>=T)
+      return T;
+  }
+
+  // stop short rather than risk passing through a surface
+  return s;
+}
+
+// earliest time of impact of a body with another awake body within dt (solve
+// |dX + t*dV| = rA+rB+m from the post-collision velocities, where m bounds the
+// drift 0.5*|dF|*t^2 of the forces), returns dt if there is none
+static dfloat spherePairImpact(const broadphase_t *awake,
+			       const dfloat dt,
+			       const int body,
+			       const bodies_t *bodies,
+			       int *pairId){
+
+  const dfloat x  = bodies->x[body],   y  = bodies->y[body],   z  = bodies->z[body];
+  const dfloat vx = bodies->nvx[body], vy = bodies->nvy[body], vz = bodies->nvz[body];
+  const dfloat fx = bodies->fx[body],  fy = bodies->fy[body],  fz = bodies->fz[body];
+  const dfloat r  = bodies->radius[body];
+
+  dfloat tPair = dt;
+  *pairId = -1;
+
+  const int ci = broadphaseCell(awake, x);
+  const int cj = broadphaseCell(awake, y);
+  const int ck = broadphaseCell(awake, z);
+
+  for(int k=ck-1;k<=ck+1;++k){
+    for(int j=cj-1;j<=cj+1;++j){
+      for(int i=ci-1;i<=ci+1;++i){
+
+	const int bucket = broadphaseBucket(awake, i, j, k);
+	const int start = awake->bucketStarts[bucket];
+	const int   end = awake->bucketStarts[bucket+1];
+	const int *contents = awake->bucketContents;
+
+	// impact times of p_simdWidth bodies at a time, then the earliest
+	for(int base=start;base<end;base+=p_simdWidth){
+	  const int len = min(p_simdWidth, end-base);
+	  dfloat toi[p_simdWidth];
+
+#pragma omp simd
+	  for(int l=0;l<len;++l){
+	    const int other = contents[base+l];
+	    const dfloat dXx = awake->sortedX[base+l]-x;
+	    const dfloat dXy = awake->sortedY[base+l]-y;
+	    const dfloat dXz = awake->sortedZ[base+l]-z;
+	    const dfloat dVx = bodies->nvx[other]-vx;
+	    const dfloat dVy = bodies->nvy[other]-vy;
+	    const dfloat dVz = bodies->nvz[other]-vz;
+	    const dfloat dFx = bodies->fx[other]-fx;
+	    const dfloat dFy = bodies->fy[other]-fy;
+	    const dfloat dFz = bodies->fz[other]-fz;
+	    const dfloat R = r + awake->sortedR[base+l];
+	    const dfloat m = 0.5*sqrt(dFx*dFx + dFy*dFy + dFz*dFz)*dt*dt;
+
+	    const dfloat a  = dVx*dVx + dVy*dVy + dVz*dVz;
+	    const dfloat b  = dXx*dVx + dXy*dVy + dXz*dVz;
+	    const dfloat d2 = dXx*dXx + dXy*dXy + dXz*dXz;
+	    const dfloat c  = d2 - (R+m)*(R+m);
+	    const dfloat disc = b*b - a*c;
+
+	    // skip self, already touching (sphereCollisions), not approaching or missing,
+	    // within the force drift of touching is an impact now
+	    const int impact = (other!=body && d2>R*R && b<0 && a>=p_eps && disc>=0);
+
+	    toi[l] = !impact ? dt : (c<=0) ? 0 : (-b - sqrt(max(disc,0)))/max(a,p_eps);
 	  }
-	    
-	  // project out gravity when in collision state
-	  dfloat gdotdisp = vectorDot(gforce, disp);
-	  //	      if(gdotdisp<0){
-	  {
-	    gforce = vectorSub(gforce, vectorScale(vectorDot(n, gforce), n));
+
+	  for(int l=0;l<len;++l){
+	    if(toi[l]<tPair){
+	      tPair = toi[l];
+	      *pairId = contents[base+l];
+	    }
 	  }
 	}
       }
-	
-      shape.sphere.force = gforce;
     }
   }
+
+  return tPair;
+}
+
+// move one body over the substep with continuous collision detection, the
+// ballistic state at dt is passed in and only replaced if there is an impact
+// Notes:
+//
+// a. static shapes: conservative advancement against the distance field from
+//    any position not already in contact (contacts at the start of the substep
+//    were handled by sphereCollisions)
+// b. spheres: earliest time of impact with an awake body, from the post-collision
+//    velocities and forces of both bodies (current on the halo after solverSolve)
+//    so that both ranks holding a pair agree
+// c. after p_ccdMaxImpacts impacts the body stops for the rest of the substep
+static void sphereSweep(const sdf_t *sdf,
+			const broadphase_t *awake,
+			const dfloat dt,
+			const dfloat g,
+			const int body,
+			const bodies_t *bodies,
+			vector_t *sweptPos,
+			vector_t *sweptVelocity){
+
+  const dfloat r = bodies->radius[body];
+  const vector_t f = vectorCreate(bodies->fx[body], bodies->fy[body], bodies->fz[body]);
+
+  int pairId;
+  const dfloat tPair = spherePairImpact(awake, dt, body, bodies, &pairId);
+
+  vector_t pos = vectorCreate(bodies->x[body], bodies->y[body], bodies->z[body]);
+  vector_t v = vectorCreate(bodies->nvx[body], bodies->nvy[body], bodies->nvz[body]);
+  dfloat t = 0;
+
+  for(int impact=0;impact<=p_ccdMaxImpacts;++impact){
+    const dfloat T = dt-t;
+
+    // time to the next static impact
+    vector_t n;
+    const dfloat clearance = sdfDistance(sdf, pos, &n) - r;
+    const dfloat sStatic = (clearance<p_ccdTolerance*r) ? T : sphereAdvance(sdf, pos, v, f, r, T, &n);
+
+    // time to the sphere impact (if it is still ahead)
+    const dfloat sPair = (pairId!=-1 && tPair>=t) ? tPair-t : T;
+
+    const dfloat s = (impact<p_ccdMaxImpacts) ? min(T, min(sStatic, sPair)) : 0;
+
+    // no impact: keep the ballistic state
+    if(impact==0 && s>=T)
+      return;
+
+    pos = vectorAdd(pos, vectorAdd(vectorScale(s, v), vectorScale(0.5*s*s, f)));
+    v = vectorAdd(v, vectorScale(s, f));
+    t += s;
+
+    if(s>=T || impact==p_ccdMaxImpacts)
+      break;
+
+    if(sPair<=sStatic){
+      // rough sphere impact with the other body at its extrapolated state
+      const vector_t otherForce = vectorCreate(bodies->fx[pairId], bodies->fy[pairId], bodies->fz[pairId]);
+      const vector_t otherStart = vectorCreate(bodies->nvx[pairId], bodies->nvy[pairId], bodies->nvz[pairId]);
+      const vector_t otherVelocity = vectorAdd(otherStart, vectorScale(t, otherForce));
+      const vector_t otherPos = vectorAdd(vectorCreate(bodies->x[pairId], bodies->y[pairId], bodies->z[pairId]),
+					  vectorAdd(vectorScale(t, otherStart), vectorScale(0.5*t*t, otherForce)));
+      const vector_t nPair = vectorNormalize(vectorSub(otherPos, pos));
+      const dfloat dVdotn = vectorDot(vectorSub(otherVelocity, v), nPair);
+      if(dVdotn<0)
+	v = vectorAdd(v, vectorScale(dVdotn, nPair));
+      pairId = -1;
+    }
+    else{
+      // bounce off the static surface as in sphereCollisions
+      n = sphereStaticNormal(n, v, g);
+      const dfloat vdotn = vectorDot(v, n);
+      if(vdotn<0){
+	dfloat bounceFactor = 1.8; // sticky at 1, bounce at 2
+	v = vectorAdd(v, vectorScale(-bounceFactor*vdotn, n));
+      }
+    }
+  }
+
+  *sweptPos = pos;
+  *sweptVelocity = v;
 }
 
-void sphereUpdates(grid_t *grid,
-		   const dfloat dt,
-		   const dfloat g,
-		   const int Nshapes,
-		   shape_t *shapes){
-  
-  for(int id=0;id<Nshapes;++id){
-    shape_t &shape = shapes[id];
-    if(shape.type == SPHERE){
-      sphere_t sphere = shape.sphere;
-      
-      sphere.velocity = sphere.newVelocity;
-      
-      // Euler-forward update position
-      shape.sphere.pos = vectorAdd(sphere.pos,
-				   vectorScale(dt, sphere.velocity));
-      
-      // Euler-forward accelerate (assume gravity in y )
-      shape.sphere.velocity = vectorAdd(sphere.velocity,
-					vectorScale(dt, sphere.force));
+// returns the number of owned bodies asleep after the update
+// (new states are swept from the old states of all bodies, then committed)
+int sphereUpdates(const sdf_t *sdf,
+		  const broadphase_t *awake,
+		  const domain_t *domain,
+		  const dfloat dt,
+		  const dfloat g,
+		  bodies_t *bodies){
+
+  const int Nowned = domain->Nowned;
+  const int *owned = domain->owned;
+
+  dfloat *x   = bodies->x,   *y   = bodies->y,   *z   = bodies->z;
+  dfloat *vx  = bodies->vx,  *vy  = bodies->vy,  *vz  = bodies->vz;
+  dfloat *nvx = bodies->nvx, *nvy = bodies->nvy, *nvz = bodies->nvz;
+  dfloat *fx  = bodies->fx,  *fy  = bodies->fy,  *fz  = bodies->fz;
+
+  int Nasleep = 0;
+
+  // swept states of the owned bodies
+  dfloat *px  = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *py  = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *pz  = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *pvx = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *pvy = (dfloat*) calloc(Nowned, sizeof(dfloat));
+  dfloat *pvz = (dfloat*) calloc(Nowned, sizeof(dfloat));
+
+  // 1. ballistic step at constant acceleration: the force found at the start
+  //    of the substep is held over it (not velocity Verlet, the force is not
+  //    evaluated again at the end of the step)
+  const dfloat halfdt2 = 0.5*dt*dt;
+
+#pragma omp parallel for simd
+  for(int n=0;n<Nowned;++n){
+    const int b = owned[n];
+    px[n]  = x[b] + (dt*nvx[b] + halfdt2*fx[b]);
+    py[n]  = y[b] + (dt*nvy[b] + halfdt2*fy[b]);
+    pz[n]  = z[b] + (dt*nvz[b] + halfdt2*fz[b]);
+    pvx[n] = nvx[b] + dt*fx[b];
+    pvy[n] = nvy[b] + dt*fy[b];
+    pvz[n] = nvz[b] + dt*fz[b];
+  }
+
+  // 2. replace the ballistic state of awake bodies that hit something
+#pragma omp parallel for schedule(dynamic, 4)
+  for(int n=0;n<Nowned;++n){
+    const int b = owned[n];
+    if(!bodies->asleep[b]){
+      vector_t pos = vectorCreate(px[n], py[n], pz[n]);
+      vector_t vel = vectorCreate(pvx[n], pvy[n], pvz[n]);
+
+      sphereSweep(sdf, awake, dt, g, b, bodies, &pos, &vel);
+
+      px[n]  = pos.x; py[n]  = pos.y; pz[n]  = pos.z;
+      pvx[n] = vel.x; pvy[n] = vel.y; pvz[n] = vel.z;
+    }
+  }
+
+  // 3. commit the new states (owned bodies are distinct so the scattered updates do not collide)
+  int *slowSteps = bodies->slowSteps;
+  int *asleep    = bodies->asleep;
+  const dfloat *radius = bodies->radius;
+
+#pragma omp parallel for simd reduction(+:Nasleep)
+  for(int n=0;n<Nowned;++n){
+    const int b = owned[n];
+    if(!asleep[b]){
+      // mean velocity and net acceleration over the substep, after the contact
+      // impulses and any impact (a sphere resting on spheres keeps its force)
+      const dfloat ux = (px[n]-x[b])/dt,   uy = (py[n]-y[b])/dt,   uz = (pz[n]-z[b])/dt;
+      const dfloat ax = (pvx[n]-vx[b])/dt, ay = (pvy[n]-vy[b])/dt, az = (pvz[n]-vz[b])/dt;
+
+      x[b]  = px[n];  y[b]  = py[n];  z[b]  = pz[n];
+      vx[b] = pvx[n]; vy[b] = pvy[n]; vz[b] = pvz[n];
+
+      // go to sleep after staying slow and supported (gravity cancelled by contacts) for long enough
+      const dfloat speed = sqrt(ux*ux + uy*uy + uz*uz);
+      const dfloat accel = sqrt(ax*ax + ay*ay + az*az);
+
+      slowSteps[b] = (speed < p_sleepRate*radius[b] && accel < p_sleepRate*fabs(g)) ? slowSteps[b]+1 : 0;
+
+      if(slowSteps[b]>=p_sleepSteps){
+	asleep[b] = 1;
+	vx[b]  = 0; vy[b]  = 0; vz[b]  = 0;
+	nvx[b] = 0; nvy[b] = 0; nvz[b] = 0;
+	fx[b]  = 0; fy[b]  = 0; fz[b]  = 0;
+      }
     }
+
+    Nasleep += asleep[b];
   }
+
+  free(px);  free(py);  free(pz);
+  free(pvx); free(pvy); free(pvz);
+
+  return Nasleep;
 }
 
+// advance the bodies by p_frameTime with adaptive substeps (collective over
+// ranks), returns the number of substeps and in Nasleep the owned bodies asleep
+int sphereFrame(const sdf_t *sdf,
+		broadphase_t *awake,
+		broadphase_t *sleeping,
+		solver_t *solver,
+		domain_t *domain,
+		const dfloat g,
+		bodies_t *bodies,
+		int *Nasleep){
+
+  dfloat physicsTime = 0;
+  int NsubSteps = 0;
+
+  *Nasleep = 0;
+
+  while(physicsTime<p_frameTime){
+
+    // sleeping bodies are only re-sorted when one falls asleep or wakes up
+    broadphaseBuild(awake,    domain, bodies);
+    broadphaseBuild(sleeping, domain, bodies);
+
+    sphereWake(domain, awake, sleeping, bodies);
+
+    // same substep on all ranks, never past the end of the frame
+    const dfloat remaining = p_frameTime-physicsTime;
+    dfloat dt = min(sphereTimeStep(domain, remaining, g, bodies), remaining);
+    if(dt<remaining && remaining<2*dt)
+      dt = remaining/2; // avoid a sliver step at the end of the frame
+
+    sphereCollisions(sdf, awake, sleeping, solver, domain, dt, g, bodies);
+
+    // no body moves more than p_cfl radii in the substep
+    sphereSpeedLimit(domain, dt, g, bodies);
+
+    *Nasleep = sphereUpdates(sdf, awake, domain, dt, g, bodies);
+
+    // refresh halo bodies and migrate bodies between slabs
+    domainHaloExchange(domain, bodies);
+
+    physicsTime = (dt<remaining) ? physicsTime+dt : p_frameTime;
+    ++NsubSteps;
+  }
+
+  return NsubSteps;
+}